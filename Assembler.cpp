@@ -1,49 +1,69 @@
 // Author: Om Prakash Behera
 #include<bits/stdc++.h>
+#if defined(__unix__)
+#include <fcntl.h> // Memory-mapped assembly sources
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 using namespace std;
 
-//Class to handle immediate values
+// Sign-extend the low bits of value, a two's complement field of that width
+inline int32_t signExtend(uint32_t value, int bits) {
+    uint32_t sign = 1u << (bits - 1);
+    return (int32_t)((value & ((sign << 1) - 1)) ^ sign) - (int32_t)sign;
+}
+
+// Class to handle immediate values
 class Immediate {
 private:
-    string value;
     int numericValue;
 
 public:
-    // Constructor for Immediate Class
-    Immediate(const string &val) : value(val), numericValue(stoi(val)) {}
+    // Constructor for Immediate Class: decimal or 0x hexadecimal, with an optional sign
+    Immediate(string_view val) {
+        string_view digits = val;
+        bool negative = !digits.empty() && digits[0] == '-';
+        if (!digits.empty() && (digits[0] == '-' || digits[0] == '+')) digits.remove_prefix(1);
+        int base = 10;
+        if (digits.size() > 2 && digits[0] == '0' && (digits[1] == 'x' || digits[1] == 'X')) {
+            digits.remove_prefix(2);
+            base = 16;
+        }
+        uint32_t magnitude = 0;
+        auto [end, error] = from_chars(digits.data(), digits.data() + digits.size(), magnitude, base);
+        if (digits.empty() || error != errc() || end != digits.data() + digits.size()) {
+            throw invalid_argument("Invalid Immediate: " + string(val));
+        }
+        numericValue = (int)(negative ? 0u - magnitude : magnitude);
+    }
     
-    string toBinary(int bits) const {
-        return bitset<32>(numericValue).to_string().substr(32 - bits);
+    // Low 'bits' bits of the two's complement value
+    uint32_t toBits(int bits) const {
+        return (uint32_t)numericValue & ((1u << bits) - 1);
     }
     
     int toInt() const {
         return numericValue;
     }
-    
-    string getUpperBits(int count) const {
-        string binary = toBinary(12);
-        return binary.substr(0, binary.size() - count);
-    }
-    
-    string getLowerBits(int count) const {
-        string binary = toBinary(12);
-        return binary.substr(binary.size() - count);
-    }
 };
 
 // Class to handle registers
 class Register {
 private:
-    string name;
     int number;
 public:
-    // Constructor for Register Class
-    Register (const string &regName) : name(regName) {
-        number = stoi(regName.substr(1));
+    // Constructor for Register Class: x0 to x31, either case
+    Register (string_view regName) {
+        auto [end, error] = from_chars(regName.data() + min<size_t>(regName.size(), 1), regName.data() + regName.size(), number);
+        if (regName.size() < 2 || (regName[0] != 'x' && regName[0] != 'X') || error != errc()
+            || end != regName.data() + regName.size() || number < 0 || number > 31) {
+            throw invalid_argument("Invalid Register: " + string(regName));
+        }
     }
     
-    string toBinary() {
-        return bitset<5>(number).to_string();
+    uint32_t toBits() {
+        return (uint32_t)number & 0x1F;
     }
     
     int getNumber() {
@@ -51,333 +71,1238 @@ public:
     }
 };
 
+// Instruction formats, named after the assembler's original type strings
+enum class Format : uint8_t { R, I, IS, L, S, B, U, UA, J, IJ };
+
+// Packed encoding descriptor of one mnemonic
+struct InstrDescriptor {
+    char mnemonic[6]; // Upper case, NUL-padded
+    Format format;
+    uint8_t opcode, funct3, funct7;
+};
+
+// The RV32I instructions the assembler accepts
+constexpr InstrDescriptor InstructionSet[] = {
+    {"ADD", Format::R, 0b0110011, 0b000, 0b0000000},
+    {"SUB", Format::R, 0b0110011, 0b000, 0b0100000},
+    {"XOR", Format::R, 0b0110011, 0b100, 0b0000000},
+    {"OR", Format::R, 0b0110011, 0b110, 0b0000000},
+    {"SLL", Format::R, 0b0110011, 0b001, 0b0000000},
+    {"SRL", Format::R, 0b0110011, 0b101, 0b0000000},
+    {"SRA", Format::R, 0b0110011, 0b101, 0b0100000},
+    {"SLT", Format::R, 0b0110011, 0b010, 0b0000000},
+    {"SLTU", Format::R, 0b0110011, 0b011, 0b0000000},
+    {"AND", Format::R, 0b0110011, 0b111, 0b0000000},
+    
+    {"ADDI", Format::I, 0b0010011, 0b000, 0},
+    {"XORI", Format::I, 0b0010011, 0b100, 0},
+    {"ORI", Format::I, 0b0010011, 0b110, 0},
+    {"ANDI", Format::I, 0b0010011, 0b111, 0},
+    {"SLTI", Format::I, 0b0010011, 0b010, 0},
+    {"SLTIU", Format::I, 0b0010011, 0b011, 0},
+    
+    {"SLLI", Format::IS, 0b0010011, 0b001, 0b0000000},
+    {"SRLI", Format::IS, 0b0010011, 0b101, 0b0000000},
+    {"SRAI", Format::IS, 0b0010011, 0b101, 0b0100000},
+    
+    {"LB", Format::L, 0b0000011, 0b000, 0},
+    {"LH", Format::L, 0b0000011, 0b001, 0},
+    {"LW", Format::L, 0b0000011, 0b010, 0},
+    {"LBU", Format::L, 0b0000011, 0b100, 0},
+    {"LHU", Format::L, 0b0000011, 0b101, 0},
+    
+    {"SB", Format::S, 0b0100011, 0b000, 0},
+    {"SH", Format::S, 0b0100011, 0b001, 0},
+    {"SW", Format::S, 0b0100011, 0b010, 0},
+    
+    {"BEQ", Format::B, 0b1100011, 0b000, 0},
+    {"BNE", Format::B, 0b1100011, 0b001, 0},
+    {"BLT", Format::B, 0b1100011, 0b100, 0},
+    {"BGE", Format::B, 0b1100011, 0b101, 0},
+    {"BLTU", Format::B, 0b1100011, 0b110, 0},
+    {"BGEU", Format::B, 0b1100011, 0b111, 0},
+    
+    {"LUI", Format::U, 0b0110111, 0, 0},
+    {"AUIPC", Format::UA, 0b0010111, 0, 0},
+    
+    {"JAL", Format::J, 0b1101111, 0, 0},
+    {"JALR", Format::IJ, 0b1100111, 0b000, 0},
+};
+
+constexpr int MnemonicHashBits = 7; // 128 slots for the 37 mnemonics
+constexpr int InstructionCount = sizeof(InstructionSet) / sizeof(InstructionSet[0]);
+
+// Pack a mnemonic of up to 5 characters into one integer, upper-cased (clearing bit 5 upper-cases letters)
+constexpr uint64_t packMnemonic(string_view name) {
+    uint64_t packed = 0;
+    for (size_t i = 0; i < name.size(); i++) packed |= (uint64_t)(uint8_t)(name[i] & 0xDF) << (8 * i);
+    return packed;
+}
+
+// Multiplicative hash of a packed mnemonic into a slot
+constexpr uint32_t mnemonicHash(uint64_t packed, uint64_t multiplier) {
+    return (uint32_t)((packed * multiplier) >> (64 - MnemonicHashBits));
+}
+
+// First multiplier in a pseudo-random sequence under which no two mnemonics share a slot, found at compile time
+constexpr uint64_t findMnemonicMultiplier() {
+    uint64_t packed[InstructionCount] = {};
+    for (int i = 0; i < InstructionCount; i++) packed[i] = packMnemonic(InstructionSet[i].mnemonic);
+    for (uint64_t seed = 1;; seed++) {
+        uint64_t multiplier = (seed * 0x9E3779B97F4A7C15ull) | 1;
+        bool used[1 << MnemonicHashBits] = {};
+        bool collision = false;
+        for (int i = 0; i < InstructionCount; i++) {
+            uint32_t slot = mnemonicHash(packed[i], multiplier);
+            collision |= used[slot];
+            used[slot] = true;
+        }
+        if (!collision) return multiplier;
+    }
+}
+
+constexpr uint64_t MnemonicMultiplier = findMnemonicMultiplier();
+
+// Perfect-hash table: each slot holds a packed mnemonic (0 if empty) and its InstructionSet index
+struct MnemonicSlot {
+    uint64_t packed;
+    uint8_t index;
+};
+
+constexpr array<MnemonicSlot, 1 << MnemonicHashBits> makeMnemonicTable() {
+    array<MnemonicSlot, 1 << MnemonicHashBits> table = {};
+    for (int i = 0; i < InstructionCount; i++) {
+        uint64_t packed = packMnemonic(InstructionSet[i].mnemonic);
+        table[mnemonicHash(packed, MnemonicMultiplier)] = {packed, (uint8_t)i};
+    }
+    return table;
+}
+
+constexpr array<MnemonicSlot, 1 << MnemonicHashBits> MnemonicTable = makeMnemonicTable();
+
+// Find a mnemonic's descriptor, in either case; null if it is not an instruction the assembler knows
+constexpr const InstrDescriptor *findInstruction(string_view mnemonic) {
+    if (mnemonic.empty() || mnemonic.size() > 5) return nullptr;
+    uint64_t packed = packMnemonic(mnemonic);
+    const MnemonicSlot &slot = MnemonicTable[mnemonicHash(packed, MnemonicMultiplier)];
+    return slot.packed == packed ? &InstructionSet[slot.index] : nullptr;
+}
+
 // Class to represent and convert RISC-V instructions
 class Instruction {
 private:
-    string opcode;
-    string rs1, rs2, rd;
-    string imm;
-    string funct3, funct7;
+    uint32_t opcode;
+    uint32_t rs1, rs2, rd; // Register numbers
+    uint32_t imm; // Two's complement immediate
+    uint32_t funct3, funct7;
     
 public:
     // Constructor for Instruction Class
-    Instruction(const string &op, const string &src1, const string &src2, const string &dest, const string &immediate, const string &f3, const string &f7)
-    : opcode(op), rs1(src1), rs2(src2), rd(dest), imm(immediate), funct3(f3), funct7(f7) {}
+    Instruction(const InstrDescriptor &desc, uint32_t src1, uint32_t src2, uint32_t dest, int32_t immediate)
+    : opcode(desc.opcode), rs1(src1), rs2(src2), rd(dest), imm((uint32_t)immediate), funct3(desc.funct3), funct7(desc.funct7) {}
     
     // Convert R-Type instruction
-    string convertRType() {
-        Register dest(rd), src1(rs1), src2(rs2);
-        return funct7 + src2.toBinary() + src1.toBinary() + funct3 + dest.toBinary() + opcode;
+    uint32_t convertRType() const {
+        return funct7 << 25 | rs2 << 20 | rs1 << 15 | funct3 << 12 | rd << 7 | opcode;
     }
     
     // Convert I-Type instruction
-    string convertIType() {
-        Register dest(rd), src1(rs1);
-        Immediate immediate(imm);
-        return immediate.toBinary(12) + src1.toBinary() + funct3 + dest.toBinary() + opcode;
+    uint32_t convertIType() const {
+        return (imm & 0xFFF) << 20 | rs1 << 15 | funct3 << 12 | rd << 7 | opcode;
     }
     
     // Convert I-Type shifting instruction
-    string convertIShiftType() {
-        Register dest(rd), src1(rs1);
-        Immediate shamt(imm);
-        return funct7 + shamt.toBinary(5) + src1.toBinary() + funct3 + dest.toBinary() + opcode;
+    uint32_t convertIShiftType() const {
+        return funct7 << 25 | (imm & 0x1F) << 20 | rs1 << 15 | funct3 << 12 | rd << 7 | opcode;
     }
     
     // Convert L(Load)-Type instruction
-    string convertLType() {
-        Register dest(rd), base(rs1);
-        Immediate offset(imm);
-        return offset.toBinary(12) + base.toBinary() + funct3 + dest.toBinary() + opcode;
+    uint32_t convertLType() const {
+        return (imm & 0xFFF) << 20 | rs1 << 15 | funct3 << 12 | rd << 7 | opcode;
     }
     
     // Convert S-Type Instruction
-    string convertSType() {
-        Register base(rs1), source(rs2);
-        Immediate offset(imm);
-        string immBinary = offset.toBinary(12);
-        return immBinary.substr(0, 7) + source.toBinary() + base.toBinary() + funct3 + immBinary.substr(7) + opcode;
+    uint32_t convertSType() const {
+        return (imm & 0xFE0) << 20 | rs2 << 20 | rs1 << 15 | funct3 << 12 | (imm & 0x1F) << 7 | opcode;
     }
     
-    // Convert B-Type Instruction
-    string convertBType() {
-        Register src1(rs1), src2(rs2);
-        Immediate offset(imm);
-        string immBinary = offset.toBinary(12);
-        return immBinary.substr(0, 7) + src2.toBinary() + src1.toBinary() + funct3 + immBinary.substr(7, 5) + opcode;
+    // Convert B-Type Instruction (word offset in the S-Type immediate layout)
+    uint32_t convertBType() const {
+        return (imm & 0xFE0) << 20 | rs2 << 20 | rs1 << 15 | funct3 << 12 | (imm & 0x1F) << 7 | opcode;
     }
     
     // Convert U-Type instruction
-    string convertUType() {
-        Register dest(rd);
-        Immediate immediate(imm);
-        return immediate.toBinary(20) + dest.toBinary() + opcode;
+    uint32_t convertUType() const {
+        return (imm & 0xFFFFF) << 12 | rd << 7 | opcode;
     }
     
-    // Convert J-Type instruction
-    string convertJType() {
-        Register dest(rd);
-        Immediate offset(imm);
-        return offset.toBinary(20) + dest.toBinary() + opcode;
+    // Convert J-Type instruction (word offset)
+    uint32_t convertJType() const {
+        return (imm & 0xFFFFF) << 12 | rd << 7 | opcode;
     }
 };
 
-// Main class for assembling RISC-V instructions
-class Assembler {
+// Render a machine word in the textual '0'/'1' dump format
+string toBinaryString(uint32_t word) {
+    return bitset<32>(word).to_string();
+}
+
+// Read-only assembly source text. A regular file is memory-mapped; stdin, pipes and anything else that
+// cannot be mapped are read into one buffer in large chunks. The text stays valid while the object lives.
+class SourceBuffer {
+public:
+    SourceBuffer() = default;
+    SourceBuffer(const SourceBuffer &) = delete;
+    SourceBuffer &operator=(const SourceBuffer &) = delete;
+    ~SourceBuffer() {
+#if defined(__unix__)
+        if (mapping) munmap(mapping, length);
+#endif
+    }
+
+    // Load a file, or stdin for "-"; returns false if it cannot be read
+    bool open(const string &path) {
+#if defined(__unix__)
+        int fd = path == "-" ? STDIN_FILENO : ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+        struct stat info;
+        if (fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0) {
+            void *map = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (map != MAP_FAILED) {
+                madvise(map, info.st_size, MADV_SEQUENTIAL);
+                mapping = map;
+                length = info.st_size;
+                if (fd != STDIN_FILENO) close(fd);
+                return true;
+            }
+        }
+        bool ok = true;
+        size_t used = 0;
+        buffer.resize(1 << 20);
+        while (true) {
+            if (used == buffer.size()) buffer.resize(used * 2);
+            ssize_t count = read(fd, &buffer[used], buffer.size() - used);
+            if (count < 0 && errno == EINTR) continue;
+            if (count <= 0) {
+                ok = count == 0;
+                break;
+            }
+            used += count;
+        }
+        buffer.resize(used);
+        if (fd != STDIN_FILENO) close(fd);
+        return ok;
+#else
+        ifstream file;
+        if (path != "-") {
+            file.open(path, ios::binary);
+            if (!file) return false;
+        }
+        ostringstream contents;
+        contents << (path == "-" ? cin.rdbuf() : file.rdbuf());
+        buffer = contents.str();
+        return true;
+#endif
+    }
+
+    string_view text() const {
+        return mapping ? string_view((const char *)mapping, length) : string_view(buffer);
+    }
+
 private:
-    unordered_map<string, tuple<string, string, string>> instructionMap = {
-        {"ADD", {"R", "000", "0000000"}},
-        {"SUB", {"R", "000", "0100000"}},
-        {"XOR", {"R", "100", "0000000"}},
-        {"OR", {"R", "110", "0000000"}},
-        {"SLL", {"R", "001", "0000000"}},
-        {"SRL", {"R", "101", "0000000"}},
-        {"SRA", {"R", "101", "0100000"}},
-        {"SLT", {"R", "010", "0000000"}},
-        {"SLTU", {"R", "011", "0000000"}},
-        
-        {"ADDI", {"I", "000", ""}},
-        {"XORI", {"I", "100", ""}},
-        {"ORI", {"I", "110", ""}},
-        {"ANDI", {"I", "111", ""}},
-        {"SLTI", {"I", "010", ""}},
-        {"SLTIU", {"I", "011", ""}},
-        
-        {"SLLI", {"IS", "001", "0000000"}},
-        {"SRLI", {"IS", "101", "0000000"}},
-        {"SRAI", {"IS", "101", "0100000"}},
-        
-        {"LB", {"L", "000", ""}},
-        {"LH", {"L", "001", ""}},
-        {"LW", {"L", "010", ""}},
-        {"LBU", {"L", "100", ""}},
-        {"LHU", {"L", "101", ""}},
-        
-        {"SB", {"S", "000", ""}},
-        {"SH", {"S", "001", ""}},
-        {"SW", {"S", "010", ""}},
-        
-        {"BEQ", {"B", "000", ""}},
-        {"BNE", {"B", "001", ""}},
-        {"BLT", {"B", "100", ""}},
-        {"BGE", {"B", "101", ""}},
-        {"BLTU", {"B", "110", ""}},
-        {"BGEU", {"B", "111", ""}},
-        
-        {"LUI", {"U", "", ""}},
-        {"AUIPC", {"U", "", ""}},
-        
-        {"JAL", {"J", "", ""}},
-        {"JALR", {"I", "000", ""}},
-    };
+    void *mapping = nullptr; // Mapped file, if the source is a regular file
+    size_t length = 0;
+    string buffer; // Source text read from a stream
+};
+
+// Split source text into lines, dropping the line terminators ("\n" or "\r\n")
+vector<string_view> splitLines(string_view text) {
+    vector<string_view> lines;
+    lines.reserve(text.size() / 16 + 1);
+    while (!text.empty()) {
+        size_t end = text.find('\n');
+        string_view line = text.substr(0, end);
+        if (!line.empty() && line.back() == '\r') line.remove_suffix(1);
+        lines.push_back(line);
+        if (end == string_view::npos) break;
+        text.remove_prefix(end + 1);
+    }
+    return lines;
+}
+
+// Splits one source line into tokens without copying. Commas and whitespace separate tokens, a token
+// ending in ':' is a label definition, and '#' or "//" starts a comment that runs to the end of the line.
+class LineTokenizer {
+public:
+    explicit LineTokenizer(string_view line) : rest(line) {}
+
+    // Next token, or an empty view at the end of the line
+    string_view next() {
+        size_t start = 0;
+        while (start < rest.size() && isSeparator(rest[start])) start++;
+        if (isComment(start)) comment = rest.substr(start);
+        size_t end = start;
+        while (end < rest.size() && !isSeparator(rest[end]) && !isComment(end)) {
+            if (rest[end++] == ':') break;
+        }
+        string_view token = isComment(start) ? string_view() : rest.substr(start, end - start);
+        rest.remove_prefix(isComment(start) ? rest.size() : end);
+        return token;
+    }
     
-    unordered_map<string, string> opcodeMap = {
-        {"R", "0110011"},
-        {"I", "0010011"},
-        {"IS", "0010011"},
-        {"L", "0000011"},
-        {"S", "0100011"},
-        {"B", "1100011"},
-        {"U", "0110111"},
-        {"J", "1101111"},
+    string_view comment; // The line's comment, including its marker, once the tokens before it are read
+
+    // Text not yet tokenized
+    string_view remaining() const {
+        return rest;
+    }
+
+private:
+    string_view rest; // Text not yet tokenized
+
+    static bool isSeparator(char c) {
+        return c == ' ' || c == '\t' || c == ',' || c == '\r';
+    }
+    bool isComment(size_t i) const {
+        return i < rest.size() && (rest[i] == '#' || (rest[i] == '/' && i + 1 < rest.size() && rest[i + 1] == '/'));
+    }
+};
+
+// One source line split into its parts, as views into the source text
+struct SourceLine {
+    string_view label; // Label defined on the line, without the colon
+    string_view mnemonic; // Empty for blank, comment-only and label-only lines
+    string_view operands[3];
+    int operandCount = 0;
+    string_view comment; // Trailing comment, including its marker
+    string_view arguments; // Untokenized text after a directive (a mnemonic starting with '.')
+};
+
+// Split a line into label, mnemonic and operands; throws invalid_argument if there are too many operands.
+// A directive's operands are left in arguments, since directives such as .word take any number of them.
+SourceLine parseLine(string_view line) {
+    SourceLine parsed;
+    LineTokenizer tokens(line);
+    string_view token = tokens.next();
+    if (!token.empty() && token.back() == ':') {
+        parsed.label = token.substr(0, token.size() - 1);
+        token = tokens.next();
+    }
+    parsed.mnemonic = token;
+    if (!token.empty() && token[0] == '.') {
+        parsed.arguments = tokens.remaining();
+        return parsed;
+    }
+    if (!token.empty()) {
+        while (!(token = tokens.next()).empty()) {
+            if (parsed.operandCount == 3) throw invalid_argument("Invalid Instruction: " + string(line));
+            parsed.operands[parsed.operandCount++] = token;
+        }
+    }
+    parsed.comment = tokens.comment;
+    return parsed;
+}
+
+// Persistent cache of line encodings for incremental assembly: an open-addressing hash table keyed by the
+// FNV-1a hash of a line's text, kept in one flat array so it is saved with one write and loaded with one read.
+// Each entry also holds the line's length and a second, 32-bit hash, so a 64-bit collision is a miss, not a reuse.
+// Label-dependent immediates are stored as zero and resolved on every run, so an entry stays valid wherever
+// its line moves and whatever its labels resolve to. The file is in the host's byte order, like any build cache.
+class EncodingCache {
+public:
+    enum Kind : uint8_t { NO_WORD, INSTRUCTION };
+    enum Reference : uint8_t { NO_REFERENCE, CODE_LABEL, DATA_LABEL };
+    struct Entry {
+        uint64_t hash; // 0 marks an empty slot
+        uint32_t word; // Encoding with any label-dependent immediate left zero
+        uint32_t check; // checkLine of the text, compared with length before the entry is reused
+        uint16_t length; // Length of the line's text
+        Kind kind; // INSTRUCTION, or NO_WORD for blank, comment and label-only lines
+        Reference reference; // Label operand: a B/J offset to a code label, or an I/L/S data address
+        uint8_t annotated; // The comment holds a trip count, which is read again on every run
+        uint8_t used; // Looked up or added since loading; only these entries are saved
+        uint16_t labelStart, labelLength; // Label defined on the line, as a range of its text
+        uint16_t referenceStart, referenceLength; // Label operand, as a range of the line's text
     };
     
-    unordered_map<string, int> labelAddresses; // Maps label names to instruction addresses
-    vector<pair<int, string>> labelReferences; // Stores positions needing label resolution
+    static uint64_t hashLine(string_view text) {
+        uint64_t hash = 14695981039346656037ull;
+        for (char c : text) hash = (hash ^ (uint8_t)c) * 1099511628211ull;
+        return hash ? hash : 1;
+    }
+    
+    // Independent check on a hashLine match: 32-bit FNV-1a over the text from its last byte to its first
+    static uint32_t checkLine(string_view text) {
+        uint32_t check = 2166136261u;
+        for (size_t i = text.size(); i-- > 0;) check = (check ^ (uint8_t)text[i]) * 16777619u;
+        return check;
+    }
+    
+    // Entry for a line's text, marked as used, or null; a slot whose hash matches but whose text differs is a miss
+    Entry *find(uint64_t hash, string_view text) {
+        if (slots.empty()) return nullptr;
+        for (size_t i = hash & (slots.size() - 1);; i = (i + 1) & (slots.size() - 1)) {
+            if (slots[i].hash == hash) {
+                if (slots[i].length != text.size() || slots[i].check != checkLine(text)) return nullptr;
+                slots[i].used = 1;
+                return &slots[i];
+            }
+            if (slots[i].hash == 0) return nullptr;
+        }
+    }
+    
+    // Add or replace an entry, growing the table to stay at most half full
+    void insert(const Entry &entry) {
+        if ((count + 1) * 2 > slots.size()) {
+            vector<Entry> old = move(slots);
+            slots.assign(max<size_t>(old.size() * 2, 1024), Entry());
+            count = 0;
+            for (const Entry &e : old) {
+                if (e.hash) place(e);
+            }
+        }
+        place(entry).used = 1;
+    }
+    
+    // Read a saved cache; a missing, truncated or inconsistent file leaves the cache empty and returns false.
+    // Nothing read is trusted: the entry count is recounted, which keeps the table at most half full so every
+    // probe in find() reaches an empty slot, and every label range must lie inside its line.
+    bool load(const string &path) {
+        slots.clear();
+        count = 0;
+        ifstream file(path, ios::binary | ios::ate);
+        uint64_t fileSize = file ? (uint64_t)file.tellg() : 0;
+        file.seekg(0);
+        char magic[4];
+        uint32_t version;
+        uint64_t size, entries;
+        file.read(magic, 4).read((char *)&version, 4).read((char *)&size, 8).read((char *)&entries, 8);
+        if (!file || memcmp(magic, "RVLC", 4) != 0 || version != FormatVersion || (size & (size - 1))
+            || size != (fileSize - 24) / sizeof(Entry) || (fileSize - 24) % sizeof(Entry)) {
+            return false;
+        }
+        slots.resize(size);
+        if (!file.read((char *)slots.data(), size * sizeof(Entry))) {
+            slots.clear();
+            return false;
+        }
+        size_t occupied = 0;
+        for (Entry &e : slots) {
+            if (!e.hash) continue;
+            occupied++;
+            e.used = 0;
+            if (e.kind > INSTRUCTION || e.reference > DATA_LABEL || e.labelStart + e.labelLength > e.length
+                || e.referenceStart + e.referenceLength > e.length) {
+                slots.clear();
+                return false;
+            }
+        }
+        if (occupied != entries || occupied * 2 > size) {
+            slots.clear();
+            return false;
+        }
+        count = occupied;
+        return true;
+    }
+    
+    // Write the entries used since loading, which drops lines that are no longer in the source
+    bool save(const string &path) const {
+        EncodingCache kept;
+        for (const Entry &e : slots) {
+            if (e.used) kept.insert(e);
+        }
+        for (Entry &e : kept.slots) e.used = 0;
+        uint32_t version = FormatVersion;
+        uint64_t size = kept.slots.size(), entries = kept.count;
+        ofstream file(path, ios::binary);
+        file.write("RVLC", 4).write((const char *)&version, 4).write((const char *)&size, 8).write((const char *)&entries, 8);
+        file.write((const char *)kept.slots.data(), size * sizeof(Entry));
+        return (bool)file;
+    }
+    
+    size_t size() const {
+        return count;
+    }
+
+private:
+    static const uint32_t FormatVersion = 2; // Bump when encodings or the entry layout change
+    vector<Entry> slots; // Power-of-two size, or empty
+    size_t count = 0;
+    
+    Entry &place(const Entry &entry) {
+        size_t i = entry.hash & (slots.size() - 1);
+        while (slots[i].hash && slots[i].hash != entry.hash) i = (i + 1) & (slots.size() - 1);
+        if (!slots[i].hash) count++;
+        return slots[i] = entry;
+    }
+};
+
+// Main class for assembling RISC-V instructions
+class Assembler {
+private:
+    unordered_map<string, int> labelAddresses; // Maps upper-case label names to instruction addresses
+    unordered_map<string, int> dataLabels; // Maps upper-case labels defined in .data to data addresses
+    // A branch, jump or data access assembled before the label it uses was defined
+    struct LabelReference {
+        int index; // Position of the word in the output
+        int line; // Source line, for the undefined-label error
+        string label; // Upper-case label name
+        bool data; // An I, L or S immediate taking a data label's address, rather than a B/J offset
+    };
+    vector<LabelReference> labelReferences; // Stores positions needing label resolution
     int currentAddress; // Tracks current instruction address
+    bool inData = false; // Lines go to the .data section rather than .text
+    int currentLine = 0; // Source line being assembled in single-pass mode
+    bool deferLabels = false; // Record unknown labels in labelReferences instead of failing
+    bool deferAll = false; // Defer known labels too, so encodings do not depend on label addresses (incremental mode)
+    string_view deferredOperand; // Operand of the last deferred label reference
+    string lookupKey; // Reused upper-case key for map lookups, so they stop allocating once it has grown
     
-    bool isLabelDefinition(const string& str) {
-        return str.back() == ':';
+    // Lines per chunk of the two-pass encoder; sources this short are encoded on the calling thread
+    static const size_t chunkLines = 16384;
+    
+    // Upper-case copy of a mnemonic or label name in key
+    static const string &upperKey(string_view name, string &key) {
+        key.assign(name.data(), name.size());
+        for (char &c : key) c = toupper((unsigned char)c);
+        return key;
     }
     
-    bool isLabelReference(const string& str) {
-        if (str.empty() || isdigit(str[0])) return false;
-        return str[0] != 'x' && str[0] != 'X';
+    // Branch and jump targets that do not start like a number are labels
+    bool isLabelReference(string_view str) {
+        if (str.empty() || isdigit((unsigned char)str[0])) return false;
+        return str[0] != '-' && str[0] != '+';
     }
     
     // To calculate relative offset between current instruction and label
     int calculateOffset(int fromAddress, int toAddress) {
         return (toAddress - fromAddress) >> 2;
     }
-
-public:
-    Assembler() : currentAddress(0) {}
-
-    // First pass: collect label positions
-    void firstPass(const vector<string>& instructions) {
+    
+    // Offset operand of a branch or jump: a number, or a label's word offset from the instruction.
+    // In single-pass mode a label that is not defined yet assembles as offset 0 and is patched later.
+    int resolveLabel(string_view operand, int address, string &key) {
+        if (!isLabelReference(operand)) return Immediate(operand).toInt();
+        auto label = labelAddresses.find(upperKey(operand, key));
+        if (deferAll || label == labelAddresses.end()) {
+            if (!deferLabels) throw invalid_argument("Undefined Label: " + key);
+            labelReferences.push_back({address / 4, currentLine, key, false});
+            deferredOperand = operand;
+            return 0;
+        }
+        return calculateOffset(address, label->second);
+    }
+    
+    // Immediate operand of an I, L or S instruction: a number, or the address of a label defined in .data.
+    // Like resolveLabel, single-pass mode assembles a label that is not defined yet as 0 and patches it later.
+    int resolveData(string_view operand, int address, string &key) {
+        if (!isLabelReference(operand)) return Immediate(operand).toInt();
+        auto label = dataLabels.find(upperKey(operand, key));
+        if (deferAll || label == dataLabels.end()) {
+            if (!deferLabels) throw invalid_argument("Undefined Label: " + key);
+            labelReferences.push_back({address / 4, currentLine, key, true});
+            deferredOperand = operand;
+            return 0;
+        }
+        return dataImmediate(label->second, key);
+    }
+    
+    // A data address used as a 12-bit signed immediate
+    static int dataImmediate(int address, const string &label) {
+        if (address > 2047) throw invalid_argument("Data Label Out Of Immediate Range: " + label);
+        return address;
+    }
+    
+    // Store a value in the immediate of an assembled word: a word offset for B-Type and J-Type,
+    // a data address for I-Type, L-Type and S-Type
+    static uint32_t patchImmediate(uint32_t word, int value) {
+        switch (word & 0x7F) {
+            case 0b1101111: // J-Type: offset in bits 31:12
+                return (word & 0xFFF) | ((uint32_t)value & 0xFFFFF) << 12;
+            case 0b0010011: // I-Type, L-Type and JALR: bits 31:20
+            case 0b0000011:
+            case 0b1100111:
+                return (word & 0xFFFFF) | ((uint32_t)value & 0xFFF) << 20;
+        }
+        uint32_t immBits = (uint32_t)value & 0xFFF; // B-Type and S-Type: split between bits 31:25 and 11:7
+        return (word & 0x01FFF07F) | (immBits >> 5) << 25 | (immBits & 0x1F) << 7;
+    }
+    
+    // Define a label at the current address of the section being assembled
+    void defineLabel(string_view label) {
+        if (inData) dataLabels[upperKey(label, lookupKey)] = dataImage.size();
+        else labelAddresses[upperKey(label, lookupKey)] = currentAddress;
+    }
+    
+    // Apply a directive: .text and .data switch sections; .word, .byte, .space and .align append to the
+    // data image and are only valid in .data
+    void assembleDirective(const SourceLine &line, string_view text) {
+        const string &name = upperKey(line.mnemonic, lookupKey);
+        LineTokenizer tokens(line.arguments);
+        vector<int> values; // Numeric operands
+        for (string_view token; !(token = tokens.next()).empty();) values.push_back(Immediate(token).toInt());
+        
+        if (name == ".TEXT" || name == ".DATA") {
+            if (!values.empty()) throw invalid_argument("Invalid Directive: " + string(text));
+            inData = name == ".DATA";
+            return;
+        }
+        if (name != ".WORD" && name != ".BYTE" && name != ".SPACE" && name != ".ALIGN") {
+            throw invalid_argument("Unknown Directive: " + string(text));
+        }
+        if (!inData) throw invalid_argument("Data Directive Outside .data: " + string(text));
+        size_t size = dataImage.size();
+        if (name == ".WORD" || name == ".BYTE") {
+            int width = name == ".WORD" ? 4 : 1;
+            if (values.empty()) throw invalid_argument("Invalid Directive: " + string(text));
+            for (int value : values) {
+                if (width == 1 && (value < -128 || value > 255)) throw invalid_argument("Byte Out Of Range: " + string(text));
+                for (int b = 0; b < width; b++) dataImage.push_back((uint32_t)value >> (8 * b)); // Little-endian
+            }
+        } else if (name == ".SPACE") { // .space bytes[, fill]
+            if (values.empty() || values.size() > 2 || values[0] < 0) throw invalid_argument("Invalid Directive: " + string(text));
+            size += values[0];
+            if (size > INT_MAX) throw invalid_argument("Data Section Too Large: " + string(text));
+            dataImage.resize(size, values.size() == 2 ? values[1] : 0);
+        } else { // .align n: pad with zeros to a multiple of 2^n bytes
+            if (values.size() != 1 || values[0] < 0 || values[0] > 12) throw invalid_argument("Invalid Directive: " + string(text));
+            size_t alignment = (size_t)1 << values[0];
+            dataImage.resize((size + alignment - 1) & ~(alignment - 1), 0);
+        }
+        if (dataImage.size() > INT_MAX) throw invalid_argument("Data Section Too Large: " + string(text));
+    }
+    
+    // Reset the label tables, sections and data image for a new source
+    void beginSource() {
         currentAddress = 0;
         labelAddresses.clear();
+        dataLabels.clear();
         labelReferences.clear();
-        
-        for (const string& line : instructions) {
-            istringstream iss(line);
-            string firstToken;
-            iss >> firstToken;
-            
-            // Handle label definitions
-            if (isLabelDefinition(firstToken)) {
-                string labelName = firstToken.substr(0, firstToken.length() - 1);
-                transform(labelName.begin(), labelName.end(), labelName.begin(), ::toupper);
-                labelAddresses[labelName] = currentAddress;
-                cout << "Label defined: " << labelName << " at address " << currentAddress << endl; // Debug output
-                
-                // Check if there's an instruction after the label on the same line
-                string instruction;
-                if (getline(iss, instruction) && !instruction.empty()) {
-                    currentAddress += 4;  // Each instruction is 4 bytes
-                }
-            } else {
-                currentAddress += 4;  // Each instruction is 4 bytes
+        tripCounts.clear();
+        dataImage.clear();
+        inData = false;
+        deferAll = false;
+    }
+    
+    // Record a "trip=N" annotation in the comment of the instruction at address
+    void recordTripCount(string_view comment, int address) {
+        size_t position = comment.find("trip=");
+        if (position == string_view::npos) return;
+        long long trips = 0;
+        string_view digits = comment.substr(position + 5);
+        auto [end, error] = from_chars(digits.data(), digits.data() + digits.size(), trips);
+        if (error != errc() || trips < 1) throw invalid_argument("Invalid trip count: " + string(comment));
+        tripCounts[address] = trips;
+    }
+    
+    // Start a single-pass assembly
+    void beginSinglePass() {
+        beginSource();
+        currentLine = 0;
+        deferLabels = true;
+    }
+    
+    // Single pass: define the line's label, then emit its instruction or data straight away
+    void assembleNextLine(string_view text, vector<uint32_t> &results, vector<int> *lineNumbers) {
+        currentLine++;
+        try {
+            SourceLine line = parseLine(text);
+            if (!line.label.empty()) defineLabel(line.label);
+            if (line.mnemonic.empty()) return; // Blank, comment or pure label line
+            if (line.mnemonic[0] == '.') {
+                assembleDirective(line, text);
+                return;
             }
+            if (inData) throw invalid_argument("Instruction In .data: " + string(text));
+            if (!line.comment.empty()) recordTripCount(line.comment, currentAddress);
+            results.push_back(assemble(line, text));
+        } catch (const invalid_argument &e) {
+            deferLabels = false;
+            throw invalid_argument("Line " + to_string(currentLine) + ": " + e.what());
         }
+        if (lineNumbers) lineNumbers->push_back(currentLine);
+        currentAddress += 4;
     }
-
-    vector<string> assembleMultiple(const vector<string>& instructions) {
-        // First pass to collect label positions
-        firstPass(instructions);
-        
-        // Second pass to assemble instructions
-        vector<string> results;
-        currentAddress = 0;
-        
-        for (const string& line : instructions) {
-            if (line.empty() || line.find_first_not_of(" \t") == string::npos) {
-                continue;  // Skip empty lines
+    
+    // End a single-pass assembly: backpatch the forward references now that every label is known
+    void finishSinglePass(vector<uint32_t> &results) {
+        deferLabels = false;
+        for (const LabelReference &reference : labelReferences) {
+            const unordered_map<string, int> &labels = reference.data ? dataLabels : labelAddresses;
+            auto label = labels.find(reference.label);
+            try {
+                if (label == labels.end()) throw invalid_argument("Undefined Label: " + reference.label);
+                int value = reference.data ? dataImmediate(label->second, reference.label)
+                                           : calculateOffset(reference.index * 4, label->second);
+                results[reference.index] = patchImmediate(results[reference.index], value);
+            } catch (const invalid_argument &e) {
+                throw invalid_argument("Line " + to_string(reference.line) + ": " + e.what());
             }
-            
-            istringstream iss(line);
-            string firstToken;
-            iss >> firstToken;
-            
-            // Skip pure label lines
-            if (isLabelDefinition(firstToken)) {
-                string remaining;
-                if (!getline(iss, remaining) || remaining.find_first_not_of(" \t") == string::npos) {
-                    continue;
-                }
-                // If there's an instruction after the label, process it
-                results.push_back(assemble(remaining));
-            } else results.push_back(assemble(line));
-            currentAddress += 4;
         }
-        
+        labelReferences.clear();
+    }
+    
+    // Incremental mode: a line found in encodingCache is replayed from its entry without being parsed or
+    // encoded. Its label uses join labelReferences, so finishSinglePass resolves them against this run's labels.
+    void assembleCachedLine(const EncodingCache::Entry &entry, string_view text, vector<uint32_t> &results,
+                            vector<int> *lineNumbers) {
+        currentLine++;
+        if (entry.labelLength) defineLabel(text.substr(entry.labelStart, entry.labelLength));
+        if (entry.kind != EncodingCache::INSTRUCTION) return;
+        if (entry.annotated) recordTripCount(parseLine(text).comment, currentAddress);
+        if (entry.reference != EncodingCache::NO_REFERENCE) {
+            upperKey(text.substr(entry.referenceStart, entry.referenceLength), lookupKey);
+            labelReferences.push_back({currentAddress / 4, currentLine, lookupKey, entry.reference == EncodingCache::DATA_LABEL});
+        }
+        results.push_back(entry.word);
+        if (lineNumbers) lineNumbers->push_back(currentLine);
+        currentAddress += 4;
+    }
+    
+    // Add a line just assembled with every label deferred to encodingCache; word is its encoding, if any.
+    // Directives are left out, since they change the section or the data image each time they run.
+    void cacheLine(uint64_t hash, string_view text, const uint32_t *word, bool referencesLabel) {
+        SourceLine line = parseLine(text);
+        if (text.size() > UINT16_MAX || (!line.mnemonic.empty() && line.mnemonic[0] == '.')) return;
+        EncodingCache::Entry entry = {};
+        entry.hash = hash;
+        entry.check = EncodingCache::checkLine(text);
+        entry.length = text.size();
+        entry.kind = word ? EncodingCache::INSTRUCTION : EncodingCache::NO_WORD;
+        entry.word = word ? *word : 0;
+        if (!line.label.empty()) {
+            entry.labelStart = line.label.data() - text.data();
+            entry.labelLength = line.label.size();
+        }
+        if (referencesLabel) {
+            entry.reference = labelReferences.back().data ? EncodingCache::DATA_LABEL : EncodingCache::CODE_LABEL;
+            entry.referenceStart = deferredOperand.data() - text.data();
+            entry.referenceLength = deferredOperand.size();
+        }
+        entry.annotated = line.comment.find("trip=") != string_view::npos;
+        encodingCache.insert(entry);
+    }
+    
+    // Incremental single pass: unchanged lines come from encodingCache, new or edited ones are assembled and
+    // added, and every B/J offset and data address is then resolved by backpatching
+    vector<uint32_t> assembleIncremental(const vector<string_view> &lines, vector<int> *lineNumbers) {
+        vector<uint32_t> results;
+        results.reserve(lines.size());
+        beginSinglePass();
+        deferAll = true;
+        cacheStats = CacheStats();
+        for (string_view text : lines) {
+            uint64_t hash = EncodingCache::hashLine(text);
+            const EncodingCache::Entry *entry = encodingCache.find(hash, text);
+            if (entry && !(inData && entry->kind == EncodingCache::INSTRUCTION)) {
+                assembleCachedLine(*entry, text, results, lineNumbers);
+                cacheStats.hits++;
+                continue;
+            }
+            size_t words = results.size(), references = labelReferences.size();
+            assembleNextLine(text, results, lineNumbers);
+            cacheLine(hash, text, results.size() > words ? &results.back() : nullptr, labelReferences.size() > references);
+            cacheStats.misses++;
+        }
+        finishSinglePass(results);
+        deferAll = false;
         return results;
     }
     
-    string assemble(string instructionStr) {
-        // Converts all instructions to upper case
-        transform(instructionStr.begin(), instructionStr.end(), instructionStr.begin(), ::toupper);
+    // Registers an encoded instruction reads and writes, as the scheduler sees it (x0 never counts)
+    struct InstrUse {
+        uint32_t rd, rs1, rs2;
+        bool load, store;
+        bool pinned; // Branches, jumps and AUIPC depend on their address and never move
+    };
+    
+    static InstrUse instrUse(uint32_t word) {
+        uint32_t rd = (word >> 7) & 0x1F, rs1 = (word >> 15) & 0x1F, rs2 = (word >> 20) & 0x1F;
+        switch (word & 0x7F) {
+            case 0b0110011: return {rd, rs1, rs2, false, false, false}; // R-Type
+            case 0b0010011: return {rd, rs1, 0, false, false, false}; // I-Type
+            case 0b0000011: return {rd, rs1, 0, true, false, false}; // L-Type
+            case 0b0100011: return {0, rs1, rs2, false, true, false}; // S-Type
+            case 0b1100011: return {0, rs1, rs2, false, false, true}; // B-Type
+            case 0b0110111: return {rd, 0, 0, false, false, false}; // LUI
+            case 0b0010111: return {rd, 0, 0, false, false, true}; // AUIPC
+            case 0b1101111: return {rd, 0, 0, false, false, true}; // JAL
+            case 0b1100111: return {rd, rs1, 0, false, false, true}; // JALR
+            default: return {0, 0, 0, false, false, true};
+        }
+    }
+    
+    // Stall cycles the pipeline's hazard check inserts between two adjacent instructions. With forwarding
+    // only a use right behind a load stalls, for one cycle; without it any use right behind its producer
+    // stalls for two. One instruction in between always hides the hazard.
+    int adjacentStalls(const InstrUse &producer, const InstrUse &consumer) const {
+        if (producer.rd == 0 || (consumer.rs1 != producer.rd && consumer.rs2 != producer.rd)) return 0;
+        return scheduleForwarding ? producer.load : 2;
+    }
+    
+    // True if b must stay after a: a register dependence (RAW, WAR, WAW) or a store ordered against
+    // another memory access
+    static bool dependsOn(const InstrUse &b, const InstrUse &a) {
+        bool raw = a.rd != 0 && (b.rs1 == a.rd || b.rs2 == a.rd);
+        bool war = b.rd != 0 && (a.rs1 == b.rd || a.rs2 == b.rd);
+        bool waw = a.rd != 0 && a.rd == b.rd;
+        bool memory = (a.store && (b.load || b.store)) || (a.load && b.store);
+        return raw || war || waw || memory;
+    }
+    
+    // Estimated data stall cycles of the code in layout order (nothing falls through a JAL or JALR)
+    int estimateStalls(const vector<uint32_t> &code) const {
+        int stalls = 0;
+        for (size_t i = 1; i < code.size(); i++) {
+            uint32_t opcode = code[i - 1] & 0x7F;
+            if (opcode == 0b1101111 || opcode == 0b1100111) continue;
+            stalls += adjacentStalls(instrUse(code[i - 1]), instrUse(code[i]));
+        }
+        return stalls;
+    }
+    
+    // List-schedule code[begin, end) on its dependence DAG. A pinned instruction can only be last, and
+    // stays there. Each step takes a ready instruction that does not stall behind the previous one,
+    // preferring the longest remaining dependence chain, then source order. previous is the instruction
+    // that falls through into the window, if any. Keeps the new order only if it stalls less.
+    bool scheduleWindow(vector<uint32_t> &code, vector<int> *lineNumbers, int begin, int end, const InstrUse *previous) {
+        int count = end - begin;
+        vector<InstrUse> uses(count);
+        for (int i = 0; i < count; i++) uses[i] = instrUse(code[begin + i]);
+        int movable = uses[count - 1].pinned ? count - 1 : count;
         
-        istringstream iss(instructionStr);
-        string mnemonic;
-        iss >> mnemonic;
+        // Dependence DAG over the movable instructions, and each node's height (longest path to a leaf)
+        vector<vector<int>> successors(movable);
+        vector<int> predecessors(movable, 0), height(movable, 1);
+        for (int j = 0; j < movable; j++) {
+            for (int i = 0; i < j; i++) {
+                if (dependsOn(uses[j], uses[i])) {
+                    successors[i].push_back(j);
+                    predecessors[j]++;
+                }
+            }
+        }
+        for (int i = movable - 1; i >= 0; i--) {
+            for (int j : successors[i]) height[i] = max(height[i], height[j] + 1 + adjacentStalls(uses[i], uses[j]));
+        }
         
-        auto it = instructionMap.find(mnemonic);
-        if (it == instructionMap.end()) {
-            return "Invalid Instruction";
+        vector<int> order;
+        const InstrUse *last = previous;
+        while ((int)order.size() < movable) {
+            int best = -1;
+            for (int i = 0; i < movable; i++) {
+                if (predecessors[i] != 0) continue;
+                auto rank = [&](int k) { return make_pair(last && adjacentStalls(*last, uses[k]) > 0, -height[k]); };
+                if (best < 0 || rank(i) < rank(best)) best = i;
+            }
+            order.push_back(best);
+            predecessors[best] = -1; // Scheduled
+            for (int j : successors[best]) predecessors[j]--;
+            last = &uses[best];
         }
+        for (int i = movable; i < count; i++) order.push_back(i);
         
-        auto [type, funct3, funct7] = it->second;
-        string opcode = opcodeMap[type];
+        // Compare the stalls inside the window, including the instruction falling into it
+        auto stalls = [&](auto position) {
+            int total = previous ? adjacentStalls(*previous, uses[position(0)]) : 0;
+            for (int i = 1; i < count; i++) total += adjacentStalls(uses[position(i - 1)], uses[position(i)]);
+            return total;
+        };
+        if (stalls([&](int i) { return order[i]; }) >= stalls([](int i) { return i; })) return false;
         
-        string arg1, arg2, arg3;
-        iss >> arg1 >> arg2 >> arg3;
+        vector<uint32_t> words(code.begin() + begin, code.begin() + end);
+        vector<int> lines = lineNumbers ? vector<int>(lineNumbers->begin() + begin, lineNumbers->begin() + end) : vector<int>();
+        for (int i = 0; i < count; i++) {
+            code[begin + i] = words[order[i]];
+            if (lineNumbers) (*lineNumbers)[begin + i] = lines[order[i]];
+        }
+        return true;
+    }
+    
+    // Scheduler pass over assembled code. Basic blocks start at labels, at branch and jump targets and after
+    // every branch, jump and AUIPC. They are scheduled in windows of at most 64 instructions. Instructions
+    // only move inside their block and a block's terminator stays last, so every block keeps its address and
+    // size: label addresses and branch offsets stay valid without re-encoding.
+    void scheduleBlocks(vector<uint32_t> &code, vector<int> *lineNumbers) {
+        const int window = 64;
+        int size = code.size();
+        vector<bool> blockStart(size + 1, false);
+        blockStart[0] = true;
+        for (auto &label : labelAddresses) {
+            if (label.second / 4 <= size) blockStart[label.second / 4] = true;
+        }
+        for (int i = 0; i < size; i++) {
+            InstrUse use = instrUse(code[i]);
+            if (!use.pinned) continue;
+            blockStart[i + 1] = true;
+            if ((code[i] & 0x7F) == 0b0010111) blockStart[i] = true; // AUIPC stays on its own
+            int offset = (code[i] & 0x7F) == 0b1100011 ? signExtend(((code[i] >> 25) << 5) | ((code[i] >> 7) & 0x1F), 12)
+                       : (code[i] & 0x7F) == 0b1101111 ? signExtend(code[i] >> 12, 20) : 0;
+            if (offset != 0 && i + offset >= 0 && i + offset <= size) blockStart[i + offset] = true;
+        }
         
-        if (type == "R") {
-            // Handle R-type instructions
-            arg1.pop_back();
-            arg2.pop_back();
-            Instruction instr(opcode, arg2, arg3, arg1, "", funct3, funct7);
-            return instr.convertRType();
-        }
-        else if (type == "I") {
-            // Handle I-type instructions
-            arg1.pop_back();
-            arg2.pop_back();
-            Instruction instr(opcode, arg2, "", arg1, arg3, funct3, "");
-            return instr.convertIType();
-        }
-        else if (type == "IS") {
-            // Handle I-Shift type instructions
-            arg1.pop_back();
-            arg2.pop_back();
-            Instruction instr(opcode, arg2, "", arg1, arg3, funct3, funct7);
-            return instr.convertIShiftType();
-        }
-        else if (type == "L" || type == "S") {
-            // Handle L-type and S-type instructions
-            arg1.pop_back();
-            size_t openBracket = arg2.find('(');
-            size_t closeBracket = arg2.find(')');
-            if (openBracket == string::npos || closeBracket == string::npos) {
-                return "Invalid Instruction";
-            }
-            string imm = arg2.substr(0, openBracket);
-            string rs1 = arg2.substr(openBracket + 1, closeBracket - openBracket - 1);
-            
-            if (type == "L") {
-                Instruction instr(opcode, rs1, "", arg1, imm, funct3, "");
-                return instr.convertLType();
-            } else { // type = "S"
-                Instruction instr(opcode, rs1, arg1, "", imm, funct3, "");
-                return instr.convertSType();
-            }
+        scheduleStats = ScheduleStats();
+        scheduleStats.stallsBefore = estimateStalls(code);
+        for (int begin = 0; begin < size;) {
+            int end = begin + 1;
+            while (end < size && !blockStart[end] && end - begin < window) end++;
+            InstrUse previous = begin > 0 ? instrUse(code[begin - 1]) : InstrUse();
+            bool fallsThrough = begin > 0 && (code[begin - 1] & 0x7F) != 0b1101111 && (code[begin - 1] & 0x7F) != 0b1100111;
+            scheduleStats.blocks++;
+            scheduleStats.reordered += scheduleWindow(code, lineNumbers, begin, end, fallsThrough ? &previous : nullptr);
+            begin = end;
         }
-        else if (type == "B") {
-            // Handle B-type instructions
-            arg1.pop_back();
-            arg2.pop_back();
-            
-            if (isLabelReference(arg3)) {
-                string labelName = arg3;
-                transform(labelName.begin(), labelName.end(), labelName.begin(), ::toupper);
-                
-                if (labelAddresses.find(labelName) != labelAddresses.end()) {
-                    int offset = calculateOffset(currentAddress, labelAddresses[labelName]);
-                    arg3 = to_string(offset);
-                } else {
-                    return "Undefined Label: " + labelName;
+        scheduleStats.stallsAfter = estimateStalls(code);
+    }
+    
+    // Assemble lines of source text; lineNumbers, if given, receives the 1-based line of each word
+    vector<uint32_t> assembleLines(const vector<string_view> &lines, vector<int> *lineNumbers) {
+        if (lineNumbers) lineNumbers->clear();
+        if (incremental) {
+            vector<uint32_t> results = assembleIncremental(lines, lineNumbers);
+            if (schedule) scheduleBlocks(results, lineNumbers);
+            return results;
+        }
+        if (singlePass && (threads <= 1 || lines.size() <= chunkLines)) {
+            vector<uint32_t> results;
+            results.reserve(lines.size());
+            beginSinglePass();
+            for (string_view line : lines) assembleNextLine(line, results, lineNumbers);
+            finishSinglePass(results);
+            if (schedule) scheduleBlocks(results, lineNumbers);
+            return results;
+        }
+        
+        // First pass to collect label positions and build the data image, and where each chunk of lines starts
+        vector<ChunkStart> chunks;
+        firstPass(lines, &chunks);
+        
+        // Second pass to assemble instructions. Chunks are independent once labels are known, so workers take
+        // them in any order and write their words straight to the chunk's place in the output.
+        vector<uint32_t> results(currentAddress / 4);
+        if (lineNumbers) lineNumbers->assign(results.size(), 0);
+        vector<string> errors(chunks.size()); // First error in each chunk
+        atomic<size_t> nextChunk(0);
+        auto worker = [&]() {
+            string key; // This worker's lookup key
+            for (size_t chunk; (chunk = nextChunk++) < chunks.size();) {
+                int address = chunks[chunk].address;
+                bool data = chunks[chunk].data;
+                for (size_t i = chunk * chunkLines; i < min(lines.size(), (chunk + 1) * chunkLines); i++) {
+                    try {
+                        SourceLine line = parseLine(lines[i]);
+                        if (line.mnemonic.empty()) continue; // Blank, comment or pure label line
+                        if (line.mnemonic[0] == '.') { // Applied by the first pass; only the section matters here
+                            const string &name = upperKey(line.mnemonic, key);
+                            if (name == ".DATA" || name == ".TEXT") data = name == ".DATA";
+                            continue;
+                        }
+                        if (data) continue;
+                        results[address / 4] = encode(line, lines[i], address, key);
+                    } catch (const invalid_argument &e) {
+                        errors[chunk] = "Line " + to_string(i + 1) + ": " + e.what();
+                        break;
+                    }
+                    if (lineNumbers) (*lineNumbers)[address / 4] = i + 1;
+                    address += 4;
                 }
             }
-            
-            Instruction instr(opcode, arg1, arg2, "", arg3, funct3, "");
-            return instr.convertBType();
-        }
-        else if (type == "J") {
-            arg1.pop_back();
-            
-            if (isLabelReference(arg2)) {
-                string labelName = arg2;
-                transform(labelName.begin(), labelName.end(), labelName.begin(), ::toupper);
+        };
+        vector<thread> workers;
+        for (size_t t = 1; t < min((size_t)max(threads, 1), chunks.size()); t++) workers.emplace_back(worker);
+        worker();
+        for (thread &w : workers) w.join();
+        
+        // Report the earliest error, as the serial assembler would
+        for (const string &error : errors) {
+            if (!error.empty()) throw invalid_argument(error);
+        }
+        if (schedule) scheduleBlocks(results, lineNumbers);
+        return results;
+    }
+
+public:
+    // Resolve forward references by backpatching in one pass over the source, instead of a label pre-pass
+    bool singlePass = true;
+    // Worker threads for the second pass. With more than one, sources longer than a chunk are assembled in
+    // two passes so the chunks can be encoded in parallel.
+    int threads = 1;
+    // Reorder instructions inside basic blocks to fill the pipeline's data-hazard stall slots
+    bool schedule = false;
+    bool scheduleForwarding = true; // Hazard model of the target pipeline: with or without forwarding
+    
+    // What the last scheduler run did; stall cycles are static estimates for the layout order
+    struct ScheduleStats {
+        int blocks = 0, reordered = 0;
+        int stallsBefore = 0, stallsAfter = 0;
+    } scheduleStats;
+    
+    // Loop trip counts annotated as "# trip=N" on a loop's backward branch or jump, by its address
+    map<int, long long> tripCounts;
+    
+    // Initial data memory from address 0, as laid out by the .data directives
+    vector<uint8_t> dataImage;
+    
+    // Reuse the encodings of lines already in encodingCache instead of parsing and encoding them again.
+    // Sources are then assembled in a single pass on one thread.
+    bool incremental = false;
+    EncodingCache encodingCache;
+    struct CacheStats {
+        int hits = 0, misses = 0;
+    } cacheStats; // Lines the last incremental run took from the cache, and lines it assembled
+    
+    Assembler() : currentAddress(0) {}
+    
+    // Where a chunk of lines starts: the address of its first instruction and the section in effect
+    struct ChunkStart {
+        int address;
+        bool data;
+    };
+
+    // First pass: collect label positions and build the data image, and record every chunkLines lines'
+    // start if asked
+    void firstPass(const vector<string_view>& lines, vector<ChunkStart> *chunks = nullptr) {
+        beginSource();
+        
+        for (size_t i = 0; i < lines.size(); i++) {
+            if (chunks && i % chunkLines == 0) chunks->push_back({currentAddress, inData});
+            try {
+                SourceLine line = parseLine(lines[i]);
                 
-                if (labelAddresses.find(labelName) != labelAddresses.end()) {
-                    int offset = calculateOffset(currentAddress, labelAddresses[labelName]);
-                    arg2 = to_string(offset);
-                } else {
-                    return "Undefined Label: " + labelName;
+                // Handle label definitions
+                if (!line.label.empty()) defineLabel(line.label);
+                if (line.mnemonic.empty()) continue;
+                if (line.mnemonic[0] == '.') {
+                    assembleDirective(line, lines[i]);
+                    continue;
                 }
+                if (inData) throw invalid_argument("Instruction In .data: " + string(lines[i]));
+                if (!line.comment.empty()) recordTripCount(line.comment, currentAddress);
+                // Each instruction is 4 bytes
+                currentAddress += 4;
+            } catch (const invalid_argument &e) {
+                throw invalid_argument("Line " + to_string(i + 1) + ": " + e.what());
             }
-            
-            Instruction instr(opcode, "", "", arg1, arg2, "", "");
-            return instr.convertJType();
         }
-        else if (type == "U") {
-            // Handle U-Type instructions
-            arg1.pop_back();
-            Instruction instr(opcode, "", "", arg1, arg2, "", "");
-            return instr.convertUType();
+    }
+
+    vector<uint32_t> assembleMultiple(const vector<string>& instructions, vector<int> *lineNumbers = nullptr) {
+        vector<string_view> lines(instructions.begin(), instructions.end());
+        return assembleLines(lines, lineNumbers);
+    }
+    
+    // Assemble a whole source text, such as a SourceBuffer's
+    vector<uint32_t> assembleSource(string_view source, vector<int> *lineNumbers = nullptr) {
+        return assembleLines(splitLines(source), lineNumbers);
+    }
+    
+    // Assemble a stream line by line in a single pass, holding only the output words and labels
+    vector<uint32_t> assembleStream(istream &in, vector<int> *lineNumbers = nullptr) {
+        vector<uint32_t> results;
+        if (lineNumbers) lineNumbers->clear();
+        string line; // Reused for every line, so it stops allocating once it has grown
+        beginSinglePass();
+        while (getline(in, line)) assembleNextLine(line, results, lineNumbers);
+        finishSinglePass(results);
+        if (schedule) scheduleBlocks(results, lineNumbers);
+        return results;
+    }
+    
+    // Assemble one instruction; throws invalid_argument on malformed input
+    uint32_t assemble(const string &instructionStr) {
+        SourceLine line = parseLine(instructionStr);
+        if (line.mnemonic.empty()) throw invalid_argument("Invalid Instruction: " + instructionStr);
+        return assemble(line, instructionStr);
+    }
+    
+    // Assemble one parsed instruction; text is the source line, for error messages
+    uint32_t assemble(const SourceLine &line, string_view text) {
+        return encode(line, text, currentAddress, lookupKey);
+    }
+    
+    // Encode an instruction placed at address. Apart from single-pass label deferral it only reads the
+    // assembler's tables, so second-pass workers can call it concurrently, each with its own key.
+    uint32_t encode(const SourceLine &line, string_view text, int address, string &key) {
+        const InstrDescriptor *desc = findInstruction(line.mnemonic);
+        // Operand count each format expects, in Format order
+        static const int operandCounts[] = {3, 3, 3, 2, 2, 3, 2, 2, 2, 3};
+        if (!desc || line.operandCount != operandCounts[(int)desc->format]) {
+            throw invalid_argument("Invalid Instruction: " + string(text));
         }
-        else {
-            return "Unsupported Instruction Type";
+        string_view arg1 = line.operands[0], arg2 = line.operands[1], arg3 = line.operands[2];
+        
+        switch (desc->format) {
+            case Format::R: // Handle R-type instructions
+                return Instruction(*desc, Register(arg2).toBits(), Register(arg3).toBits(), Register(arg1).toBits(), 0).convertRType();
+            case Format::I: // Handle I-type instructions
+            case Format::IJ:
+                return Instruction(*desc, Register(arg2).toBits(), 0, Register(arg1).toBits(), resolveData(arg3, address, key)).convertIType();
+            case Format::IS: // Handle I-Shift type instructions
+                return Instruction(*desc, Register(arg2).toBits(), 0, Register(arg1).toBits(), Immediate(arg3).toInt()).convertIShiftType();
+            case Format::L: // Handle L-type and S-type instructions: offset(base), where an empty offset is zero
+            case Format::S: { // and the offset may be a data label
+                size_t openBracket = arg2.find('(');
+                size_t closeBracket = arg2.find(')');
+                if (openBracket == string_view::npos || closeBracket == string_view::npos || closeBracket < openBracket) {
+                    throw invalid_argument("Invalid Instruction: " + string(text));
+                }
+                int offset = openBracket == 0 ? 0 : resolveData(arg2.substr(0, openBracket), address, key);
+                uint32_t base = Register(arg2.substr(openBracket + 1, closeBracket - openBracket - 1)).toBits();
+                if (desc->format == Format::L) {
+                    return Instruction(*desc, base, 0, Register(arg1).toBits(), offset).convertLType();
+                }
+                return Instruction(*desc, base, Register(arg1).toBits(), 0, offset).convertSType();
+            }
+            case Format::B: // Handle B-type instructions
+                return Instruction(*desc, Register(arg1).toBits(), Register(arg2).toBits(), 0, resolveLabel(arg3, address, key)).convertBType();
+            case Format::J:
+                return Instruction(*desc, 0, 0, Register(arg1).toBits(), resolveLabel(arg2, address, key)).convertJType();
+            case Format::U: // Handle U-Type instructions
+            case Format::UA:
+                return Instruction(*desc, 0, 0, Register(arg1).toBits(), Immediate(arg2).toInt()).convertUType();
         }
+        throw invalid_argument("Unsupported Instruction Type: " + string(text));
     }
 };
 
-int main() {
+// Print what the scheduler pass changed
+void printScheduleReport(ostream &out, const Assembler &assembler) {
+    const Assembler::ScheduleStats &stats = assembler.scheduleStats;
+    out << "Scheduler: " << stats.reordered << " of " << stats.blocks << " blocks reordered, estimated data stalls "
+        << stats.stallsBefore << " -> " << stats.stallsAfter << " (" << stats.stallsBefore - stats.stallsAfter
+        << " removed, " << (assembler.scheduleForwarding ? "with" : "without") << " forwarding)" << endl;
+}
+
+// Write a flat program image for the simulator's --image: a 24-byte header, then the code words and the data
+// image. The header is "RVFI", format version 1, then the file offset and byte size of .text and of .data,
+// all little-endian. Returns false if the file cannot be written.
+bool writeProgramImage(const string &path, const vector<uint32_t> &code, const vector<uint8_t> &data) {
+    const uint32_t headerSize = 24, textSize = code.size() * 4;
+    vector<uint8_t> image(headerSize + textSize + data.size());
+    auto put = [&](size_t offset, uint32_t word) {
+        for (int b = 0; b < 4; b++) image[offset + b] = word >> (8 * b);
+    };
+    memcpy(image.data(), "RVFI", 4);
+    put(4, 1);
+    put(8, headerSize);
+    put(12, textSize);
+    put(16, headerSize + textSize);
+    put(20, data.size());
+    for (size_t i = 0; i < code.size(); i++) put(headerSize + 4 * i, code[i]);
+    copy(data.begin(), data.end(), image.begin() + headerSize + textSize);
+    ofstream file(path, ios::binary);
+    file.write((const char *)image.data(), image.size());
+    return (bool)file;
+}
+
+// Print how much of the last incremental assembly came from the encoding cache
+void printCacheReport(ostream &out, const Assembler &assembler) {
+    const Assembler::CacheStats &stats = assembler.cacheStats;
+    out << "Encoding cache: " << stats.hits << " of " << stats.hits + stats.misses << " lines reused, "
+        << stats.misses << " assembled" << endl;
+}
+
+// Parse a whole decimal option value of at least minimum into value; false leaves the caller to print usage
+template <typename T>
+bool parseOptionValue(const string &text, T &value, long long minimum) {
+    T parsed = 0;
+    auto [end, error] = from_chars(text.data(), text.data() + text.size(), parsed);
+    if (text.empty() || error != errc() || end != text.data() + text.size() || parsed < minimum) return false;
+    value = parsed;
+    return true;
+}
+
+int main(int argc, char *argv[]) {
     Assembler assembler;
+    assembler.threads = max(1u, thread::hardware_concurrency());
+    string sourcePath, outputPath = "-"; // Assembly file (- for stdin) and machine code destination
+    string dataPath; // Where to write the data image, if anywhere
+    string imagePath; // Where to write a program image (code and data), if anywhere
+    string cachePath; // Encoding cache for incremental assembly, if any
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "-o" && i + 1 < argc) outputPath = argv[++i];
+        else if (arg == "-d" && i + 1 < argc) dataPath = argv[++i];
+        else if (arg == "-b" && i + 1 < argc) imagePath = argv[++i];
+        else if (arg == "--two-pass") assembler.singlePass = false;
+        else if (arg.rfind("--cache=", 0) == 0) cachePath = arg.substr(8);
+        else if (arg.rfind("--threads=", 0) == 0 && parseOptionValue(arg.substr(10), assembler.threads, 1)) continue;
+        else if (arg == "--schedule" || arg == "--schedule=no-forwarding") {
+            assembler.schedule = true;
+            assembler.scheduleForwarding = arg == "--schedule";
+        }
+        else if (sourcePath.empty() && (arg == "-" || arg[0] != '-')) sourcePath = arg;
+        else {
+            cout << "Usage: " << argv[0] << " [SOURCE.s|-] [-o OUTPUT] [-d DATA] [-b IMAGE] [--cache=FILE] [--two-pass] [--threads=N] [--schedule[=no-forwarding]]" << endl
+                 << "  Without a source, assembles the built-in sample and prints a listing." << endl
+                 << "  DATA receives the .data image as raw bytes from address 0; IMAGE, code and data for --image." << endl
+                 << "  --cache reassembles incrementally, reusing and updating the encodings saved in FILE." << endl;
+            return 1;
+        }
+    }
+    
+    // Source file mode: write the machine code, one binary word per line.
+    // With one thread, stdin is streamed through the single pass; otherwise the source is read as a whole.
+    if (!cachePath.empty()) {
+        assembler.incremental = true;
+        assembler.encodingCache.load(cachePath); // Starts empty if there is no usable cache yet
+    }
+    if (!sourcePath.empty()) {
+        SourceBuffer source;
+        bool stream = sourcePath == "-" && assembler.singlePass && assembler.threads == 1 && !assembler.incremental;
+        if (!stream && !source.open(sourcePath)) {
+            cout << "Cannot read source file: " << sourcePath << endl;
+            return 1;
+        }
+        vector<uint32_t> machineCodes;
+        try {
+            if (stream) ios::sync_with_stdio(false);
+            machineCodes = stream ? assembler.assembleStream(cin) : assembler.assembleSource(source.text());
+        } catch (const exception& e) {
+            cout << "Error during assembly: " << e.what() << endl;
+            return 1;
+        }
+        string text;
+        text.reserve(machineCodes.size() * 33);
+        for (uint32_t word : machineCodes) {
+            for (int bit = 31; bit >= 0; bit--) text += (char)('0' + (word >> bit & 1));
+            text += '\n';
+        }
+        if (assembler.schedule) printScheduleReport(cerr, assembler);
+        if (assembler.incremental) {
+            printCacheReport(cerr, assembler);
+            if (!assembler.encodingCache.save(cachePath)) {
+                cout << "Cannot write cache file: " << cachePath << endl;
+                return 1;
+            }
+        }
+        ofstream file;
+        if (outputPath != "-") file.open(outputPath, ios::binary);
+        ostream &out = outputPath == "-" ? cout : file;
+        out.write(text.data(), text.size());
+        out.flush();
+        if (!out) {
+            cout << "Cannot write output file: " << outputPath << endl;
+            return 1;
+        }
+        if (!dataPath.empty()) {
+            ofstream data(dataPath, ios::binary);
+            data.write((const char *)assembler.dataImage.data(), assembler.dataImage.size());
+            if (!data) {
+                cout << "Cannot write data file: " << dataPath << endl;
+                return 1;
+            }
+        }
+        if (!imagePath.empty() && !writeProgramImage(imagePath, machineCodes, assembler.dataImage)) {
+            cout << "Cannot write image file: " << imagePath << endl;
+            return 1;
+        }
+        return 0;
+    }
+    
     vector<string> instructions = {
         // Sum of n numbers
-        "lw x5, 11(x6)", //int n = 10
+        "lw x5, 44(x6)", //int n = 10
         "addi x1, x1, 1",
         "addi x5, x5, 1",
         "sum_loop:",
@@ -403,16 +1328,18 @@ int main() {
         // "addi x2, x2, 1",
         // "jal x6, for",
         // "done:",
-        // "sw x3, 1(x0)"
+        // "sw x3, 4(x0)"
     };
     
     try {
-        vector<string> machineCodes = assembler.assembleMultiple(instructions);
+        vector<int> lineNumbers;
+        vector<uint32_t> machineCodes = assembler.assembleMultiple(instructions, &lineNumbers);
         cout << "\nGenerated Machine Codes:" << endl;
         for (size_t i = 0; i < machineCodes.size(); ++i) {
-            cout << "Instruction " << i << ": " << instructions[i] << endl;
-            cout << "Machine Code: " << machineCodes[i] << endl << endl;
+            cout << "Instruction " << i << ": " << instructions[lineNumbers[i] - 1] << endl;
+            cout << "Machine Code: " << toBinaryString(machineCodes[i]) << endl << endl;
         }
+        if (assembler.schedule) printScheduleReport(cout, assembler);
     } catch (const exception& e) {
         cout << "Error during assembly: " << e.what() << endl;
     }
@@ -1,15 +1,151 @@
 #include <bits/stdc++.h>
+#if defined(__x86_64__)
+#include <immintrin.h> // AVX2 lanes for the lockstep simulator
+#endif
+#if defined(__unix__)
+#include <fcntl.h> // Memory-mapped program images
+#include <sys/mman.h> // Also the executable buffer for the JIT
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 using namespace std;
 
-vector<string> iMem; // Instruction memory
-int pc; // Program counter
-int dMem[1024] = {0}; // Data memory
-int GPR[32] = {0}; // General purpose registers
-int instrNum; // Number of instructions
+// Raised when a guest access is misaligned or falls outside the data address space
+class MemoryFault : public runtime_error {
+public:
+    uint32_t address; // Faulting guest address
+    MemoryFault(const string &message, uint32_t addr) : runtime_error(message), address(addr) {}
+};
+
+// Sparse byte-addressable data memory: a 32-bit little-endian address space whose 4 KiB pages
+// are allocated on first store through a two-level page table (10 + 10 + 12 address bits).
+// Untouched pages read as zero, or from a mapped image, so a program only pays for the pages it writes.
+class GuestMemory {
+public:
+    static const int PAGE_BITS = 12, TABLE_BITS = 10;
+    static const uint32_t PAGE_SIZE = 1u << PAGE_BITS;
+
+    explicit GuestMemory(uint64_t size = 1ull << 32) : limit(size) {}
+
+    // Load with the width and extension given by the L-type funct3 (LB, LH, LW, LBU, LHU)
+    int load(uint32_t address, int funct3) const {
+        check(address, funct3, "load");
+        const uint8_t *page = findPage(address);
+        if (!page) return 0;
+        const uint8_t *p = page + (address & (PAGE_SIZE - 1));
+        switch (funct3) {
+            case 0b000: return (int8_t)p[0]; // LB
+            case 0b001: return (int16_t)(p[0] | p[1] << 8); // LH
+            case 0b100: return p[0]; // LBU
+            case 0b101: return p[0] | p[1] << 8; // LHU
+            default: return (int)(p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24); // LW
+        }
+    }
+
+    // Store the low byte, half or word of value as given by the S-type funct3 (SB, SH, SW)
+    void store(uint32_t address, int funct3, int value) {
+        check(address, funct3, "store");
+        uint8_t *p = getPage(address) + (address & (PAGE_SIZE - 1));
+        int width = 1 << (funct3 & 3);
+        for (int i = 0; i < width; i++) p[i] = (uint32_t)value >> (8 * i);
+    }
+
+    // Aligned word access used by the loaders and the state dump
+    int read32(uint32_t address) const { return load(address, 0b010); }
+    void write32(uint32_t address, int value) { store(address, 0b010, value); }
+
+    // Copy an image of size bytes to address, one memcpy per page it covers
+    void loadImage(uint32_t address, const uint8_t *data, size_t size) {
+        if (address + (uint64_t)size > limit) throw MemoryFault("data image out of range", address);
+        while (size > 0) {
+            size_t offset = address & (PAGE_SIZE - 1), count = min<size_t>(size, PAGE_SIZE - offset);
+            memcpy(getPage(address) + offset, data, count);
+            address += count;
+            data += count;
+            size -= count;
+        }
+    }
+
+    // Back memory from address 0 with a read-only image, such as a mapped program file, which must outlive
+    // this memory. Loads read its pages in place and the first store to a page copies it, so nothing is
+    // copied up front except a partial last page.
+    void mapImage(const uint8_t *data, size_t size) {
+        if (size > limit) throw MemoryFault("data image out of range", 0);
+        image = data;
+        imagePages = size / PAGE_SIZE;
+        size_t tail = imagePages * PAGE_SIZE;
+        loadImage(tail, data + tail, size - tail);
+    }
 
-bitset<32> regLock; // Register lock status
-bool skip = false; // Flag to skip execution
-bool hazard[2] = {false, false}; // {data hazard stall, control hazard stall}
+    // True if both memories hold the same bytes everywhere; pages never written or mapped count as zero
+    bool operator==(const GuestMemory &other) const {
+        static const uint8_t zeroPage[PAGE_SIZE] = {};
+        for (size_t d = 0; d < directory.size(); d++) {
+            bool mapped = (d << TABLE_BITS) < max(imagePages, other.imagePages);
+            if (!directory[d] && !other.directory[d] && !mapped) continue;
+            for (size_t t = 0; t < (1u << TABLE_BITS); t++) {
+                uint32_t address = (uint32_t)(d << TABLE_BITS | t) << PAGE_BITS;
+                const uint8_t *a = findPage(address), *b = other.findPage(address);
+                if ((a || b) && memcmp(a ? a : zeroPage, b ? b : zeroPage, PAGE_SIZE) != 0) return false;
+            }
+        }
+        return true;
+    }
+
+private:
+    using Page = unique_ptr<uint8_t[]>;
+    using Table = array<Page, 1u << TABLE_BITS>;
+    uint64_t limit; // Size of the address space in bytes
+    array<unique_ptr<Table>, 1u << (32 - PAGE_BITS - TABLE_BITS)> directory; // First-level table
+    const uint8_t *image = nullptr; // Read-only pages behind the untouched ones from address 0 (mapImage)
+    size_t imagePages = 0;
+
+    // Fault on a misaligned access, an invalid width or an address past the end of memory
+    void check(uint32_t address, int funct3, const char *kind) const {
+        int width = 1 << (funct3 & 3);
+        bool validWidth = (funct3 & 3) != 3 && !(kind[0] == 's' && funct3 > 0b010);
+        if (validWidth && !(address & (width - 1)) && address + (uint64_t)width <= limit) return;
+        fault(address, funct3, kind);
+    }
+
+    // Throw the MemoryFault for an access check() rejected; out of line so the hot path stays small
+    [[noreturn]] void fault(uint32_t address, int funct3, const char *kind) const;
+
+    // Page holding an address: the written copy, else the mapped image's page, else null
+    const uint8_t *findPage(uint32_t address) const {
+        const Table *table = directory[address >> (PAGE_BITS + TABLE_BITS)].get();
+        const uint8_t *page = table ? (*table)[address >> PAGE_BITS & ((1u << TABLE_BITS) - 1)].get() : nullptr;
+        if (!page && (address >> PAGE_BITS) < imagePages) return image + (address & ~(PAGE_SIZE - 1));
+        return page;
+    }
+
+    // Page holding an address, allocated on first use as a copy of the mapped image's page or zero-filled
+    uint8_t *getPage(uint32_t address) {
+        unique_ptr<Table> &table = directory[address >> (PAGE_BITS + TABLE_BITS)];
+        if (!table) table.reset(new Table());
+        Page &page = (*table)[address >> PAGE_BITS & ((1u << TABLE_BITS) - 1)];
+        if (!page) {
+            if ((address >> PAGE_BITS) < imagePages) {
+                page.reset(new uint8_t[PAGE_SIZE]);
+                memcpy(page.get(), image + (address & ~(PAGE_SIZE - 1)), PAGE_SIZE);
+            } else {
+                page.reset(new uint8_t[PAGE_SIZE]());
+            }
+        }
+        return page.get();
+    }
+};
+
+// Describe the rejected access and throw it as a MemoryFault
+[[noreturn]] void GuestMemory::fault(uint32_t address, int funct3, const char *kind) const {
+    int width = 1 << (funct3 & 3);
+    stringstream msg;
+    if ((funct3 & 3) == 3 || (kind[0] == 's' && funct3 > 0b010)) msg << "invalid " << kind << " width";
+    else if (address & (width - 1)) msg << "misaligned " << width << "-byte " << kind;
+    else msg << width << "-byte " << kind << " out of range";
+    msg << " at address 0x" << hex << address;
+    throw MemoryFault(msg.str(), address);
+}
 
 // Structure to hold the state flags for different pipeline stages
 struct flags {
@@ -19,78 +155,833 @@ struct flags {
     bool execute = false; // Execute stage state
     bool memory = false; // Memory stage state
     bool writeback = false; // Writeback stage state
-} states;
+};
 
 // Control word structure to hold control signals for each instruction type
+// ALUSrc selects operand 2 (0 = rs2, 1 = immediate, 2 = constant 4 for links)
+// ALUSrcA selects operand 1 (0 = rs1, 1 = PC, 2 = zero)
+// Jump is 1 for PC-relative JAL and 2 for register-indirect JALR
 struct CtrlWord {
-    int RegRead, RegWrite, ALUSrc, ALUOp, Branch, Jump, MemRead, MemWrite, MemToReg;
+    int8_t RegRead, RegWrite, ALUSrc, ALUOp, Branch, Jump, MemRead, MemWrite, MemToReg, ALUSrcA;
 };
 
+// Build the control unit table indexed directly by the 7-bit opcode
+constexpr array<CtrlWord, 128> makeControlUnit() {
+    array<CtrlWord, 128> table = {}; // Unknown opcodes decode to all-zero signals (a bubble)
+    table[0b0110011] = {1, 1, 0, 0b10, 0, 0, 0, 0, 0, 0};  // R-Type
+    table[0b0010011] = {1, 1, 1, 0b11, 0, 0, 0, 0, 0, 0};  // I-Type
+    table[0b0000011] = {1, 1, 1, 0b00, 0, 0, 1, 0, 1, 0};  // L-Type
+    table[0b0100011] = {1, 0, 1, 0b00, 0, 0, 0, 1, -1, 0}; // S-Type
+    table[0b1100011] = {1, 0, 0, 0b01, 1, 0, 0, 0, -1, 0}; // B-Type
+    table[0b0110111] = {0, 1, 1, 0b00, 0, 0, 0, 0, 0, 2};  // U-Type (LUI)
+    table[0b0010111] = {0, 1, 1, 0b00, 0, 0, 0, 0, 0, 1};  // U-Type (AUIPC)
+    table[0b1101111] = {0, 1, 2, 0b00, 0, 1, 0, 0, 0, 1};  // J-Type (JAL)
+    table[0b1100111] = {1, 1, 2, 0b00, 0, 2, 0, 0, 0, 1};  // I-Type (JALR)
+    return table;
+}
+
 // Control unit mapping opcodes to control signals
-map<string, CtrlWord> ControlUnit = {
-    {"0110011", {1, 1, 0, 10, 0, 0, 0, 0, 0}},  // R-Type
-    {"0010011", {1, 1, 1, 11, 0, 0, 0, 0, 0}},  // I-Type
-    {"0000011", {1, 1, 1, 00, 0, 0, 1, 0, 1}},  // L-Type
-    {"0100011", {1, 0, 1, 00, 0, 0, 0, 1, -1}}, // S-Type
-    {"1100011", {1, 0, 0, 01, 1, 0, 0, 0, -1}}, // B-Type
-    {"0110111", {0, 1, 1, 00, 0, 0, 0, 0, 0}},  // U-Type
-    {"1101111", {0, 1, 0, 00, 0, 1, 0, 0, 0}}   // J-Type
-};
-
-// Utility class for binary and decimal conversions
-class Utility {
+constexpr array<CtrlWord, 128> ControlUnit = makeControlUnit();
+
+// ALU operations, encoded as 4-bit ALU select lines
+enum class ALUSel : uint8_t {
+    AND = 0b0000, OR = 0b0001, ADD = 0b0010, SLL = 0b0011,
+    XOR = 0b0100, SRL = 0b0101, SUB = 0b0110, SLT = 0b0111,
+    SLTU = 0b1000, SRA = 0b1001, Invalid = 0b1111
+};
+
+// Build the ALU control table indexed by ALUOp, funct7[5] and funct3
+constexpr array<ALUSel, 64> makeALUCtrlTable() {
+    // Register/immediate operations and branch comparisons ordered by funct3
+    const ALUSel arith[8] = {ALUSel::ADD, ALUSel::SLL, ALUSel::SLT, ALUSel::SLTU, ALUSel::XOR, ALUSel::SRL, ALUSel::OR, ALUSel::AND};
+    const ALUSel compare[8] = {ALUSel::SUB, ALUSel::SUB, ALUSel::Invalid, ALUSel::Invalid, ALUSel::SLT, ALUSel::SLT, ALUSel::SLTU, ALUSel::SLTU};
+    array<ALUSel, 64> table = {};
+    for (int func = 0; func < 8; func++) {
+        for (int alt = 0; alt < 2; alt++) {
+            table[0b00 << 4 | alt << 3 | func] = ALUSel::ADD;     // Address and link computation
+            table[0b01 << 4 | alt << 3 | func] = compare[func];   // B-Type
+            table[0b11 << 4 | alt << 3 | func] = arith[func];     // I-Type
+        }
+        table[0b10 << 4 | func] = arith[func];                    // R-Type
+        table[0b10 << 4 | 1 << 3 | func] = ALUSel::Invalid;
+    }
+    table[0b10 << 4 | 1 << 3 | 0b000] = ALUSel::SUB; // SUB
+    table[0b10 << 4 | 1 << 3 | 0b101] = ALUSel::SRA; // SRA
+    table[0b11 << 4 | 1 << 3 | 0b101] = ALUSel::SRA; // SRAI
+    return table;
+}
+
+constexpr array<ALUSel, 64> ALUCtrlTable = makeALUCtrlTable();
+
+// Determine the ALU control signal based on operation type
+ALUSel ALUCtrl(int ALUOp, int func, int func7) {
+    // Instruction bit 30 (funct7[5]) selects SUB/SRA over ADD/SRL
+    return ALUCtrlTable[ALUOp << 4 | ((func7 >> 5) & 1) << 3 | func];
+}
+
+// Functional interpreter handler for a decoded instruction, one per operation.
+// Writes to x0 are decoded to EXEC_NOP (or EXEC_J/EXEC_JR for jumps), so handlers never check rd.
+enum ExecOp : uint8_t {
+    EXEC_ADD, EXEC_SUB, EXEC_AND, EXEC_OR, EXEC_XOR, EXEC_SLL, EXEC_SRL, EXEC_SRA, EXEC_SLT, EXEC_SLTU,
+    EXEC_ADDI, EXEC_ANDI, EXEC_ORI, EXEC_XORI, EXEC_SLLI, EXEC_SRLI, EXEC_SRAI, EXEC_SLTI, EXEC_SLTIU,
+    EXEC_LB, EXEC_LH, EXEC_LW, EXEC_LBU, EXEC_LHU, EXEC_SB, EXEC_SH, EXEC_SW,
+    EXEC_BEQ, EXEC_BNE, EXEC_BLT, EXEC_BGE, EXEC_BLTU, EXEC_BGEU,
+    EXEC_LUI, EXEC_AUIPC, EXEC_JAL, EXEC_J, EXEC_JALR, EXEC_JR,
+    EXEC_NOP, // No architectural effect: unknown opcodes and results written to x0
+    EXEC_GENERIC, // Anything unusual (invalid ALU or memory functions, loads to x0), through the generic path
+    EXEC_COUNT
+};
+
+// Pre-decoded instruction record, built once per program so the pipeline never re-slices instruction strings
+struct DecodedInstr {
+    uint8_t opcode, rd, rs1, rs2, funct3, funct7; // Instruction fields
+    int32_t imm; // Sign-extended immediate of the instruction's format
+    CtrlWord control; // Control signals for the opcode
+    ALUSel aluSel; // ALU operation resolved from ALUOp, funct3 and funct7
+    ExecOp exec; // Functional interpreter handler
+};
+
+// Pick the interpreter handler for a decoded instruction
+ExecOp selectExecOp(const DecodedInstr &decoded) {
+    // Register and immediate operations in ALUSel order (AND .. SRA); Invalid has no entry
+    static const ExecOp regOps[10] = {EXEC_AND, EXEC_OR, EXEC_ADD, EXEC_SLL, EXEC_XOR, EXEC_SRL, EXEC_SUB, EXEC_SLT, EXEC_SLTU, EXEC_SRA};
+    static const ExecOp immOps[10] = {EXEC_ANDI, EXEC_ORI, EXEC_ADDI, EXEC_SLLI, EXEC_XORI, EXEC_SRLI, EXEC_GENERIC, EXEC_SLTI, EXEC_SLTIU, EXEC_SRAI};
+    // Loads, stores and branches by funct3; EXEC_GENERIC where the function is invalid
+    static const ExecOp loadOps[8] = {EXEC_LB, EXEC_LH, EXEC_LW, EXEC_GENERIC, EXEC_LBU, EXEC_LHU, EXEC_GENERIC, EXEC_GENERIC};
+    static const ExecOp storeOps[8] = {EXEC_SB, EXEC_SH, EXEC_SW, EXEC_GENERIC, EXEC_GENERIC, EXEC_GENERIC, EXEC_GENERIC, EXEC_GENERIC};
+    static const ExecOp branchOps[8] = {EXEC_BEQ, EXEC_BNE, EXEC_GENERIC, EXEC_GENERIC, EXEC_BLT, EXEC_BGE, EXEC_BLTU, EXEC_BGEU};
+
+    bool validALU = decoded.aluSel != ALUSel::Invalid;
+    switch (decoded.opcode) {
+        case 0b0110011: // R-Type
+        case 0b0010011: // I-Type
+            if (!validALU) return EXEC_GENERIC; // Keeps the invalid-operation report
+            if (decoded.rd == 0) return EXEC_NOP;
+            return (decoded.opcode == 0b0110011 ? regOps : immOps)[(int)decoded.aluSel];
+        case 0b0000011: return decoded.rd == 0 ? EXEC_GENERIC : loadOps[decoded.funct3]; // L-Type, x0 still faults
+        case 0b0100011: return storeOps[decoded.funct3]; // S-Type
+        case 0b1100011: return branchOps[decoded.funct3]; // B-Type
+        case 0b0110111: return decoded.rd == 0 ? EXEC_NOP : EXEC_LUI;
+        case 0b0010111: return decoded.rd == 0 ? EXEC_NOP : EXEC_AUIPC;
+        case 0b1101111: return decoded.rd == 0 ? EXEC_J : EXEC_JAL;
+        case 0b1100111: return decoded.rd == 0 ? EXEC_JR : EXEC_JALR;
+        default: return EXEC_NOP;
+    }
+}
+
+// Sign-extend the low bits of value, a two's complement field of that width
+inline int32_t signExtend(uint32_t value, int bits) {
+    uint32_t sign = 1u << (bits - 1);
+    return (int32_t)((value & ((sign << 1) - 1)) ^ sign) - (int32_t)sign;
+}
+
+// Decode the fields, immediate and control signals of a machine word, leaving the ALU and interpreter
+// selections unset (all the static timing estimate needs)
+DecodedInstr decodeFields(uint32_t word) {
+    DecodedInstr decoded = {};
+    decoded.opcode = word & 0x7F;
+    decoded.rd = (word >> 7) & 0x1F;
+    decoded.funct3 = (word >> 12) & 0x7;
+    decoded.rs1 = (word >> 15) & 0x1F;
+    decoded.rs2 = (word >> 20) & 0x1F;
+    decoded.funct7 = word >> 25;
+
+    // Sign-extend the immediate according to the instruction format
+    switch (decoded.opcode) {
+        case 0b0010011: // I-Type
+        case 0b0000011: // L-Type
+        case 0b1100111: // JALR
+            decoded.imm = (int32_t)word >> 20;
+            break;
+        case 0b0100011: // S-Type
+        case 0b1100011: // B-Type (word offset)
+            decoded.imm = signExtend(((word >> 25) << 5) | decoded.rd, 12);
+            break;
+        case 0b0110111: // U-Type (LUI)
+        case 0b0010111: // U-Type (AUIPC)
+            decoded.imm = (int32_t)(word & 0xFFFFF000);
+            break;
+        case 0b1101111: // J-Type (word offset)
+            decoded.imm = (int32_t)word >> 12;
+            break;
+    }
+
+    decoded.control = ControlUnit[decoded.opcode];
+    return decoded;
+}
+
+// Decode one machine word into its fields, immediate and control signals
+DecodedInstr decodeInstr(uint32_t word) {
+    DecodedInstr decoded = decodeFields(word);
+    decoded.aluSel = ALUCtrl(decoded.control.ALUOp, decoded.funct3, decoded.funct7);
+    decoded.exec = selectExecOp(decoded);
+    return decoded;
+}
+
+// Branch predictor interface: fetch asks for a direction, execute trains it with the outcome
+class BranchPredictor {
 public:
-    // Convert binary string to decimal integer
-    int toDec(string binary) {
-        int result = 0;
-        int len = binary.length();
-        bool negative = (binary[0] == '1');
-
-        // Handle positive numbers normally
-        if (!negative) {
-            for (int i = 0; i < len; i++) {
-                if (binary[len - 1 - i] == '1') {
-                    result += (1 << i);
+    virtual ~BranchPredictor() {}
+    virtual bool predict(int pc) = 0; // Predict whether the conditional branch at pc is taken
+    virtual void update(int pc, bool taken) = 0; // Train with the resolved direction
+};
+
+// Static predictor: conditional branches are always predicted not taken
+class StaticNotTaken : public BranchPredictor {
+public:
+    bool predict(int) override { return false; }
+    void update(int, bool) override {}
+};
+
+// Branch history table of 2-bit saturating counters indexed by the branch address
+class BimodalPredictor : public BranchPredictor {
+private:
+    vector<uint8_t> counters; // 0-1 predict not taken, 2-3 predict taken
+public:
+    BimodalPredictor(int entries = 1024) : counters(entries, 1) {}
+    bool predict(int pc) override { return counters[(pc >> 2) & (counters.size() - 1)] >= 2; }
+    void update(int pc, bool taken) override {
+        uint8_t &counter = counters[(pc >> 2) & (counters.size() - 1)];
+        if (taken && counter < 3) counter++;
+        if (!taken && counter > 0) counter--;
+    }
+};
+
+// Gshare: 2-bit counters indexed by the branch address XORed with the global history
+class GsharePredictor : public BranchPredictor {
+private:
+    vector<uint8_t> counters;
+    unsigned history = 0; // Outcomes of the most recent branches, newest in bit 0
+    unsigned index(int pc) const { return ((pc >> 2) ^ history) & (counters.size() - 1); }
+public:
+    GsharePredictor(int entries = 1024) : counters(entries, 1) {}
+    bool predict(int pc) override { return counters[index(pc)] >= 2; }
+    void update(int pc, bool taken) override {
+        uint8_t &counter = counters[index(pc)];
+        if (taken && counter < 3) counter++;
+        if (!taken && counter > 0) counter--;
+        history = (history << 1) | taken;
+    }
+};
+
+// Direct-mapped branch target buffer holding the targets of recently executed branches and jumps
+class BranchTargetBuffer {
+private:
+    struct Entry {
+        int pc = -1; // Address of the branch or jump, -1 when empty
+        int target = 0; // Taken target
+        bool conditional = false; // Conditional branches consult the direction predictor
+    };
+    vector<Entry> entries;
+public:
+    BranchTargetBuffer(int size = 64) : entries(size) {}
+    const Entry *lookup(int pc) const {
+        const Entry &entry = entries[(pc >> 2) & (entries.size() - 1)];
+        return entry.pc == pc ? &entry : nullptr;
+    }
+    void update(int pc, int target, bool conditional) {
+        Entry &entry = entries[(pc >> 2) & (entries.size() - 1)];
+        entry.pc = pc;
+        entry.target = target;
+        entry.conditional = conditional;
+    }
+};
+
+// Set-associative cache timing model in front of iMem/dMem. Only tags are tracked;
+// the data itself always lives in the backing memory.
+class Cache {
+public:
+    enum Replacement { LRU, PLRU, RANDOM };
+    struct Config {
+        int size = 4096; // Capacity in bytes
+        int lineSize = 32; // Bytes per line
+        int ways = 2; // Associativity
+        Replacement replacement = LRU;
+        bool writeBack = true; // Write-back with write-allocate, or write-through without it
+        int missLatency = 10; // Cycles to fill a line, and again to write back a dirty victim
+    };
+    long long accesses = 0, misses = 0, writebacks = 0; // Statistics
+
+    Cache(const Config &cfg) : config(cfg), sets(cfg.size / (cfg.lineSize * cfg.ways)), lines(sets * cfg.ways), plruBits(sets, 0) {}
+
+    // Look up an address and return the cycles the access has to wait (0 on a hit)
+    int access(uint32_t address, bool write) {
+        accesses++;
+        uint32_t block = address / config.lineSize;
+        int set = block % sets;
+        uint32_t tag = block / sets;
+        Line *way = &lines[set * config.ways];
+        for (int i = 0; i < config.ways; i++) {
+            if (way[i].valid && way[i].tag == tag) {
+                touch(set, i);
+                if (write && config.writeBack) way[i].dirty = true;
+                return 0;
+            }
+        }
+        misses++;
+        if (write && !config.writeBack) return 0; // The store goes straight to memory through a write buffer
+
+        int victim = chooseVictim(set);
+        int latency = config.missLatency;
+        if (way[victim].valid && way[victim].dirty) {
+            writebacks++;
+            latency += config.missLatency;
+        }
+        way[victim].tag = tag;
+        way[victim].valid = true;
+        way[victim].dirty = write;
+        touch(set, victim);
+        return latency;
+    }
+
+    const Config &getConfig() const { return config; }
+
+private:
+    struct Line {
+        uint32_t tag = 0;
+        bool valid = false, dirty = false;
+        uint64_t lastUse = 0; // LRU timestamp
+    };
+    Config config;
+    int sets;
+    vector<Line> lines; // sets * ways lines, one set after another
+    vector<uint32_t> plruBits; // Tree-PLRU node bits per set, node n at bit n
+    uint64_t useClock = 0;
+    mt19937 rng{1}; // Fixed seed keeps random replacement reproducible
+
+    // Record a use of a way for the replacement policy
+    void touch(int set, int way) {
+        lines[set * config.ways + way].lastUse = ++useClock;
+        // Point every tree node on the path away from the way just used
+        int node = 1;
+        for (int half = config.ways / 2; half > 0; half /= 2) {
+            bool right = way & half;
+            if (right) plruBits[set] &= ~(1u << node);
+            else plruBits[set] |= 1u << node;
+            node = node * 2 + right;
+        }
+    }
+
+    // Pick the way to evict: an invalid way if there is one, else per the replacement policy
+    int chooseVictim(int set) {
+        Line *way = &lines[set * config.ways];
+        for (int i = 0; i < config.ways; i++) {
+            if (!way[i].valid) return i;
+        }
+        if (config.replacement == RANDOM) return rng() % config.ways;
+        if (config.replacement == PLRU) {
+            int node = 1, victim = 0;
+            for (int half = config.ways / 2; half > 0; half /= 2) {
+                bool right = plruBits[set] >> node & 1;
+                if (right) victim += half;
+                node = node * 2 + right;
+            }
+            return victim;
+        }
+        int victim = 0;
+        for (int i = 1; i < config.ways; i++) {
+            if (way[i].lastUse < way[victim].lastUse) victim = i;
+        }
+        return victim;
+    }
+};
+
+// Parse a whole decimal option value of at least minimum into value; false leaves the caller to print usage
+template <typename T>
+bool parseOptionValue(const string &text, T &value, long long minimum) {
+    T parsed = 0;
+    auto [end, error] = from_chars(text.data(), text.data() + text.size(), parsed);
+    if (text.empty() || error != errc() || end != text.data() + text.size() || parsed < minimum) return false;
+    value = parsed;
+    return true;
+}
+
+// Parse "size:line:ways:lru|plru|random:wb|wt:latency"; trailing fields may be left out, but every number
+// must be a whole decimal field
+bool parseCacheConfig(const string &spec, Cache::Config &config) {
+    vector<string> fields;
+    stringstream ss(spec);
+    string field;
+    while (getline(ss, field, ':')) fields.push_back(field);
+    if (fields.size() > 6) return false;
+    if (fields.size() > 0 && !parseOptionValue(fields[0], config.size, 1)) return false;
+    if (fields.size() > 1 && !parseOptionValue(fields[1], config.lineSize, 1)) return false;
+    if (fields.size() > 2 && !parseOptionValue(fields[2], config.ways, 1)) return false;
+    if (fields.size() > 5 && !parseOptionValue(fields[5], config.missLatency, 0)) return false;
+    if (fields.size() > 3) {
+        if (fields[3] == "lru") config.replacement = Cache::LRU;
+        else if (fields[3] == "plru") config.replacement = Cache::PLRU;
+        else if (fields[3] == "random") config.replacement = Cache::RANDOM;
+        else return false;
+    }
+    if (fields.size() > 4) {
+        if (fields[4] == "wb") config.writeBack = true;
+        else if (fields[4] == "wt") config.writeBack = false;
+        else return false;
+    }
+    auto powerOfTwo = [](int x) { return x > 0 && (x & (x - 1)) == 0; };
+    return powerOfTwo(config.lineSize) && powerOfTwo(config.ways) && config.ways <= 16 && config.missLatency >= 0
+        && config.size >= config.lineSize * config.ways && config.size % (config.lineSize * config.ways) == 0;
+}
+
+// Hardware performance counters, updated by the pipeline stages as they work
+struct PerfCounters {
+    long long cycles = 0; // Simulated cycles, numbered like the per-cycle dump
+    long long instret = 0; // Instructions retired by writeback
+    long long functionalInstret = 0; // Instructions committed by the functional model
+    long long dataHazards = 0; // Dependencies checkHazards had to stall for
+    long long dataStalls = 0; // Bubbles inserted while waiting for a producer
+    long long controlStalls = 0; // Bubbles from stalling fetch on a branch or jump (no predictor)
+    long long flushes = 0; // Wrong-path instructions squashed after a misprediction
+    long long icacheStalls = 0, dcacheStalls = 0; // Cycles fetch / the memory stage waited on a cache miss
+    long long branches = 0, branchesTaken = 0, jumps = 0, mispredictions = 0; // Control flow resolved in execute
+    long long loads = 0, stores = 0; // Memory operations completed
+};
+
+// Specialised operations a translated basic block is built from. Each one fixes the ALU operation
+// and operand source, so running it needs no further decoding.
+enum BlockKind : uint8_t {
+    R_AND, R_OR, R_ADD, R_SLL, R_XOR, R_SRL, R_SUB, R_SLT, R_SLTU, R_SRA, // rd = rs1 op rs2, in ALUSel order
+    I_AND, I_OR, I_ADD, I_SLL, I_XOR, I_SRL, I_SUB, I_SLT, I_SLTU, I_SRA, // rd = rs1 op imm, in ALUSel order
+    OP_LOAD, OP_LOAD_X0, OP_STORE, // Memory access with the funct3 width; OP_LOAD_X0 discards the value
+    OP_LI, // rd = imm; LUI and AUIPC both become this since the PC is known at translation time
+    OP_GENERIC, // Anything else with a register result, through ALUExec
+    // Block exits
+    EXIT_BEQ, EXIT_BNE, EXIT_BLT, EXIT_BGE, EXIT_BLTU, EXIT_BGEU, EXIT_JAL, EXIT_JALR,
+    EXIT_FALLTHROUGH // The block runs into the end of the program or an unconditional fall-through
+};
+
+struct BlockOp {
+    BlockKind kind;
+    uint8_t rd, rs1, rs2; // rs2 holds funct3 for loads and stores
+    int32_t imm;
+    ALUSel aluSel; // Used by OP_GENERIC only
+    uint32_t offset; // Instructions from the block's start, so a memory fault can commit the ones before it
+};
+
+// A basic block translated once: straight-line ops, one exit, and direct links to its successors.
+// Translation follows direct JALs, so a block may span several guest basic blocks.
+struct TranslatedBlock {
+    int startPC;
+    int length; // Guest instructions in the block, exit included
+    vector<BlockOp> ops;
+    vector<int> opPCs; // Guest PC of each op, to leave pc at a faulting memory access
+    BlockOp exit;
+    int takenPC, fallthroughPC; // Successor PCs; takenPC is the branch or JAL target
+    TranslatedBlock *taken = nullptr, *fallthrough = nullptr; // Chained successors, filled in on first use
+    long long execCount = 0; // Times the interpreter ran the block, for the JIT's hotness check
+    void *native = nullptr; // JIT-compiled code for the block, if any
+};
+
+// Translate the basic block starting at pc: instructions up to and including the first branch or jump.
+// A JAL to a known target is followed instead of ending the block, at most MaxMergedJumps times,
+// so a loop body that jumps back to its test runs as one block; its link write becomes an OP_LI.
+// The caller owns the new block.
+TranslatedBlock *translateBlock(const vector<DecodedInstr> &decodedMem, int pc) {
+    const int instrNum = decodedMem.size();
+    const int MaxMergedJumps = 4;
+    TranslatedBlock *block = new TranslatedBlock();
+    block->startPC = pc;
+    block->exit = BlockOp{EXIT_FALLTHROUGH, 0, 0, 0, 0, ALUSel::Invalid, 0};
+    int at = pc, count = 0, mergedJumps = 0;
+    for (; (unsigned)at < (unsigned)instrNum * 4; at += 4, count++) {
+        const DecodedInstr &instr = decodedMem[at >> 2];
+        BlockOp op{OP_GENERIC, instr.rd, instr.rs1, instr.rs2, instr.imm, instr.aluSel, 0};
+        bool isExit = true;
+        switch (instr.opcode) {
+            case 0b1100011: { // B-Type
+                static const BlockKind branchKinds[8] = {EXIT_BEQ, EXIT_BNE, EXIT_FALLTHROUGH, EXIT_FALLTHROUGH,
+                                                         EXIT_BLT, EXIT_BGE, EXIT_BLTU, EXIT_BGEU};
+                op.kind = branchKinds[instr.funct3];
+                block->takenPC = at + instr.imm * 4;
+                break;
+            }
+            case 0b1101111: { // JAL
+                int target = at + instr.imm * 4;
+                if (mergedJumps < MaxMergedJumps && (unsigned)target < (unsigned)instrNum * 4) {
+                    mergedJumps++;
+                    if (instr.rd) {
+                        block->ops.push_back(BlockOp{OP_LI, instr.rd, 0, 0, at + 4, ALUSel::Invalid, (uint32_t)count});
+                        block->opPCs.push_back(at);
+                    }
+                    at = target - 4; // The loop steps to the target
+                    continue;
                 }
+                op.kind = EXIT_JAL;
+                block->takenPC = target;
+                break;
             }
-            return result;
+            case 0b1100111: op.kind = EXIT_JALR; break; // JALR
+            default: isExit = false; break;
+        }
+        if (isExit) {
+            block->exit = op;
+            at += 4;
+            count++;
+            break;
+        }
+
+        bool isALU = instr.aluSel <= ALUSel::SRA;
+        switch (instr.opcode) {
+            case 0b0110011: if (isALU) op.kind = (BlockKind)(R_AND + (int)instr.aluSel); break; // R-Type
+            case 0b0010011: if (isALU) op.kind = (BlockKind)(I_AND + (int)instr.aluSel); break; // I-Type
+            case 0b0000011: op.kind = instr.rd ? OP_LOAD : OP_LOAD_X0; op.rs2 = instr.funct3; break; // L-Type
+            case 0b0100011: op.kind = OP_STORE; op.rd = instr.rs2; op.rs2 = instr.funct3; break; // S-Type
+            case 0b0110111: op.kind = OP_LI; break; // LUI
+            case 0b0010111: op.kind = OP_LI; op.imm = at + instr.imm; break; // AUIPC
+            default: continue; // No architectural effect
+        }
+        // Register writes to x0 vanish; a load still has to access memory
+        if (instr.rd == 0 && op.kind != OP_STORE && op.kind != OP_LOAD_X0) continue;
+        op.offset = count;
+        block->ops.push_back(op);
+        block->opPCs.push_back(at);
+    }
+    block->length = count;
+    block->fallthroughPC = at;
+    return block;
+}
+
+#if defined(__x86_64__) && defined(__unix__)
+// x86-64 code generator for hot translated blocks. Guest registers stay in the pinned GPR array
+// (rdi), and compiled blocks jump straight into each other's code, so a hot loop stays native.
+// Every block entry checks and debits an instruction budget kept in rsi. A block that contains
+// something the generator does not handle (memory access, JALR, invalid ALU operations) is left
+// to the interpreter: guest memory faults are C++ exceptions and cannot unwind through JIT frames.
+// The buffer is never writable and executable at once: it is read-execute except while compile() runs.
+// With a lane mask the code is for LockstepSimulator instead: rdi points at its GPR rows, each op is one
+// AVX2 operation across the row, and a branch the lanes disagree on hands its own PC back unretired.
+class JitCompiler {
+public:
+    // Run compiled code from a block entry; returns the next guest PC and stores the unused budget
+    typedef int (*Entry)(int32_t *regs, long long budget, long long *remaining);
+
+    explicit JitCompiler(unsigned laneMask = 0, size_t size = 1 << 20) : laneMask(laneMask), capacity(size) {
+        void *buffer = mmap(nullptr, capacity, PROT_READ | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        code = buffer == MAP_FAILED ? nullptr : (uint8_t *)buffer;
+    }
+    ~JitCompiler() {
+        if (code) munmap(code, capacity);
+    }
+
+    // Compile a block; returns its entry point, or null if the block or the buffer rules it out.
+    // blockCache is used to link exits straight to successors that are already compiled.
+    void *compile(const TranslatedBlock &block, const vector<unique_ptr<TranslatedBlock>> &blockCache) {
+        size_t opBytes = laneMask ? MaxLaneOpBytes : MaxOpBytes;
+        if (!code || capacity - used < MaxBlockOverhead + opBytes * block.ops.size()) return nullptr;
+        for (const BlockOp &op : block.ops) {
+            if (op.kind >= OP_LOAD && op.kind != OP_LI) return nullptr;
+        }
+        if (block.exit.kind == EXIT_JALR) return nullptr;
+        if (mprotect(code, capacity, PROT_READ | PROT_WRITE) != 0) return nullptr;
+
+        size_t start = used;
+        size_t bail; // Patch site for the jump to the bail-out path
+        exitSites.clear();
+        fill(ymmRow, ymmRow + 16, -1);
+        nextYmm = FirstRowYmm;
+        // cmp rsi, length; jl bail; sub rsi, length
+        emit({0x48, 0x81, 0xFE}); emit32(block.length);
+        emit({0x0F, 0x8C}); bail = used; emit32(0);
+        emit({0x48, 0x81, 0xEE}); emit32(block.length);
+
+        for (const BlockOp &op : block.ops) {
+            if (laneMask) emitLaneOp(op);
+            else emitOp(op);
+        }
+
+        const BlockOp &exit = block.exit;
+        size_t takenJump = 0, splitJump = 0;
+        if (laneMask && exit.kind <= EXIT_BGEU && exit.kind >= EXIT_BEQ) {
+            emitLaneBranch(exit);
+            emit({0x0F, 0x84}); takenJump = used; emit32(0); // je taken
+            emit({0x85, 0xC0}); // test eax, eax
+            emit({0x0F, 0x85}); splitJump = used; emit32(0); // jne split
+        } else if (laneMask && exit.kind == EXIT_JAL && exit.rd) {
+            broadcast(0, block.fallthroughPC); // Scratch is enough: no op follows to reuse it
+            storeRow(0, exit.rd);
+        } else if (exit.kind <= EXIT_BGEU && exit.kind >= EXIT_BEQ) {
+            static const uint8_t conditions[6] = {0x84, 0x85, 0x8C, 0x8D, 0x82, 0x83}; // je jne jl jge jb jae
+            loadReg(0, exit.rs1);
+            emit({0x3B, 0x47, disp(exit.rs2)}); // cmp eax, [rdi + rs2]
+            emit({0x0F, conditions[exit.kind - EXIT_BEQ]});
+            takenJump = used;
+            emit32(0);
+        } else if (exit.kind == EXIT_JAL && exit.rd) {
+            emit({0xC7, 0x47, disp(exit.rd)}); emit32(block.fallthroughPC); // mov dword [rdi + rd], link
+        }
+        if (exit.kind != EXIT_JAL) emitExit(block.fallthroughPC, blockCache);
+        if (takenJump) patch(takenJump, used);
+        if (exit.kind == EXIT_JAL || takenJump) emitExit(block.takenPC, blockCache);
+        if (splitJump) { // Give the branch back to the caller, which splits the lanes
+            patch(splitJump, used);
+            emit({0x48, 0xFF, 0xC6}); // inc rsi
+            emit(0xB8); emit32(block.fallthroughPC - 4); // mov eax, branch PC
+            emit(0xE9); exitSites.push_back(used); emit32(0);
+        }
+
+        // Bail out before running the block when the budget is short: hand its PC back to the interpreter
+        patch(bail, used);
+        emit(0xB8); emit32(block.startPC); // mov eax, startPC
+        emit(0xE9); exitSites.push_back(used); emit32(0);
+        for (size_t site : exitSites) patch(site, used);
+        emit({0x48, 0x89, 0x32}); // mov [rdx], rsi
+        if (laneMask) emit({0xC5, 0xF8, 0x77}); // vzeroupper
+        emit(0xC3); // ret
+
+        // The reservation above covers the worst case; should it ever fall short, drop the partial block
+        if (used > capacity) {
+            used = start;
+            while (!pendingLinks.empty() && pendingLinks.back().first >= start) pendingLinks.pop_back();
+            makeExecutable();
+            return nullptr;
+        }
+
+        // Link earlier blocks that were waiting for this one
+        for (size_t i = 0; i < pendingLinks.size();) {
+            if (pendingLinks[i].second == block.startPC) {
+                patch(pendingLinks[i].first, start);
+                pendingLinks[i] = pendingLinks.back();
+                pendingLinks.pop_back();
+            } else i++;
         }
-        
-        // For negative numbers, use 2's complement
-        string inverted = binary; // Invert all bits
-        for (int i = 0; i < len; i++) {
-            inverted[i] = (binary[i] == '1') ? '0' : '1';
+        makeExecutable();
+        return code + start;
+    }
+
+    // Drop all compiled code
+    void reset() {
+        used = 0;
+        pendingLinks.clear();
+    }
+
+private:
+    // Worst-case code size: entry check 20, branch 12 (lanes 79), two exits 20, split exit 13 and bail-out
+    // plus epilogue 17 bytes, and at most 17 bytes per op (SLTI; lanes 69, SLTIU), all rounded up
+    static const size_t MaxBlockOverhead = 160, MaxOpBytes = 24, MaxLaneOpBytes = 80;
+
+    unsigned laneMask; // Lanes in use for LockstepSimulator code, 0 for Simulator code
+    uint8_t *code = nullptr;
+    size_t capacity, used = 0;
+    vector<pair<size_t, int>> pendingLinks; // (rel32 patch site, guest PC) of exits to blocks not compiled yet
+    vector<size_t> exitSites; // Jumps in the block being compiled that go to its epilogue
+
+    // Hand the buffer back to execution once emitting and linking are done. Code compiled earlier
+    // would be unrunnable if this failed, so it is not something to fall back from.
+    void makeExecutable() {
+        if (mprotect(code, capacity, PROT_READ | PROT_EXEC) != 0) throw runtime_error("cannot make JIT code executable");
+    }
+
+    // Emitters never write past the buffer; used still advances, so compile() sees the overflow
+    void emit(uint8_t byte) {
+        if (used < capacity) code[used] = byte;
+        used++;
+    }
+    void emit(initializer_list<uint8_t> bytes) {
+        for (uint8_t byte : bytes) emit(byte);
+    }
+    void emit32(int32_t value) {
+        if (used + 4 <= capacity) memcpy(code + used, &value, 4);
+        used += 4;
+    }
+    // Point the rel32 at site to target
+    void patch(size_t site, size_t target) {
+        int32_t rel = (int32_t)(target - (site + 4));
+        if (site + 4 <= capacity) memcpy(code + site, &rel, 4);
+    }
+    static uint8_t disp(int reg) { return reg * 4; }
+    // mov eax/ecx, [rdi + reg]
+    void loadReg(int hostReg, int reg) { emit({0x8B, (uint8_t)(0x47 | hostReg << 3), disp(reg)}); }
+
+    // Leave the block for a guest PC: jump to the successor's code if it is compiled, otherwise return
+    // the PC. The jump is linked later if the successor gets compiled.
+    void emitExit(int pc, const vector<unique_ptr<TranslatedBlock>> &blockCache) {
+        emit(0xB8); emit32(pc); // mov eax, pc
+        emit(0xE9);
+        size_t site = used;
+        emit32(0);
+        const TranslatedBlock *next = (unsigned)pc / 4 < blockCache.size() && pc % 4 == 0 ? blockCache[pc >> 2].get() : nullptr;
+        if (next && next->native) patch(site, (uint8_t *)next->native - code);
+        else {
+            exitSites.push_back(site);
+            if ((unsigned)pc / 4 < blockCache.size()) pendingLinks.push_back({site, pc});
+        }
+    }
+
+    // One straight-line op: eax = rs1 op operand; [rdi + rd] = eax
+    void emitOp(const BlockOp &op) {
+        if (op.kind == OP_LI) {
+            emit({0xC7, 0x47, disp(op.rd)}); emit32(op.imm); // mov dword [rdi + rd], imm
+            return;
         }
-        
-        // Convert inverted bits to decimal
-        for (int i = 0; i < len; i++) {
-            if (inverted[len - 1 - i] == '1') {
-                result += (1 << i);
+        bool imm = op.kind >= I_AND;
+        ALUSel sel = (ALUSel)(op.kind - (imm ? I_AND : R_AND));
+        loadReg(0, op.rs1);
+        switch (sel) {
+            case ALUSel::SLL: case ALUSel::SRL: case ALUSel::SRA: {
+                uint8_t ext = sel == ALUSel::SLL ? 0xE0 : sel == ALUSel::SRL ? 0xE8 : 0xF8;
+                if (imm) emit({0xC1, ext, (uint8_t)(op.imm & 31)}); // shl/shr/sar eax, imm8
+                else {
+                    loadReg(1, op.rs2);
+                    emit({0xD3, ext}); // shl/shr/sar eax, cl (the hardware masks the count to 5 bits)
+                }
+                break;
+            }
+            case ALUSel::SLT: case ALUSel::SLTU:
+                if (imm) { emit(0x3D); emit32(op.imm); } // cmp eax, imm32
+                else emit({0x3B, 0x47, disp(op.rs2)}); // cmp eax, [rdi + rs2]
+                emit({0x0F, (uint8_t)(sel == ALUSel::SLT ? 0x9C : 0x92), 0xC0}); // setl/setb al
+                emit({0x0F, 0xB6, 0xC0}); // movzx eax, al
+                break;
+            default: {
+                // add, sub, and, or, xor: register form opcode, immediate form is opcode + 2 (eax, imm32)
+                uint8_t opcode = sel == ALUSel::ADD ? 0x03 : sel == ALUSel::SUB ? 0x2B : sel == ALUSel::AND ? 0x23
+                               : sel == ALUSel::OR ? 0x0B : 0x33;
+                if (imm) { emit(opcode + 2); emit32(op.imm); }
+                else emit({opcode, 0x47, disp(op.rs2)});
+                break;
             }
         }
-        return -(result + 1); // Add 1 and make negative
+        emit({0x89, 0x47, disp(op.rd)}); // mov [rdi + rd], eax
     }
 
-    // Convert decimal integer to binary string
-    string toBin(int decimal) {
-        bitset<32> binary(decimal);
-        return binary.to_string();
+    // Lane code. Guest register reg is the 32-byte row at [rdi + reg * 32]. Within a block, rows stay in
+    // ymm3-ymm15 once loaded or written; every write also goes to the row, so an exit has nothing to flush.
+    // ymm0-ymm2 are scratch.
+    static const int FirstRowYmm = 3;
+    int ymmRow[16]; // Guest register each ymm holds in the block being compiled, -1 for none
+    int nextYmm; // Next row register to reuse, round robin
+
+    // AVX2 instruction with a three-byte VEX prefix (map 1 is 0F, 2 is 0F38; pp 1 is 66, 2 is F3).
+    // rm is a register, or with row given that guest register's memory.
+    void vex(int map, int pp, uint8_t opcode, int reg, int vvvv, int rm, int row = -1, bool ymm = true) {
+        emit({0xC4, (uint8_t)((reg < 8) << 7 | 1 << 6 | (rm < 8 || row >= 0) << 5 | map),
+              (uint8_t)((~vvvv & 15) << 3 | ymm << 2 | pp), opcode});
+        if (row >= 0) { emit((uint8_t)(0x87 | (reg & 7) << 3)); emit32(row * 32); }
+        else emit((uint8_t)(0xC0 | (reg & 7) << 3 | (rm & 7)));
+    }
+    void loadRow(int ymm, int reg) { vex(1, 2, 0x6F, ymm, 0, 0, reg); } // vmovdqu ymm, [rdi + row]
+    void storeRow(int ymm, int reg) { vex(1, 2, 0x7F, ymm, 0, 0, reg); } // vmovdqu [rdi + row], ymm
+    // Fill every lane of ymm with value
+    void broadcast(int ymm, int32_t value) {
+        emit(0xB8); emit32(value); // mov eax, value
+        vex(1, 1, 0x6E, ymm, 0, 0, -1, false); // vmovd xmm, eax
+        vex(2, 1, 0x58, ymm, 0, ymm); // vpbroadcastd ymm, xmm
+    }
+    // Flip the sign bits of a and b into ymm0 and ymm1, so signed comparisons order them as unsigned
+    void flipSigns(int &a, int &b) {
+        broadcast(2, INT_MIN);
+        vex(1, 1, 0xEF, 0, a, 2); // vpxor ymm0, a, ymm2
+        vex(1, 1, 0xEF, 1, b, 2); // vpxor ymm1, b, ymm2
+        a = 0;
+        b = 1;
     }
 
-    // Sign-extend the immediate value
-    int signExtend(const string& immediate) {
-        string extendedBits = (immediate[0] == '0') ? "000000000000" : "111111111111";
-        return toDec(extendedBits + immediate);
+    // Free up a row register other than keep1 and keep2
+    int takeYmm(int keep1, int keep2) {
+        int ymm;
+        do {
+            ymm = nextYmm;
+            nextYmm = nextYmm == 15 ? FirstRowYmm : nextYmm + 1;
+        } while (ymm == keep1 || ymm == keep2);
+        ymmRow[ymm] = -1;
+        return ymm;
+    }
+    // Register holding guest register reg, loaded from its row if no register has it yet
+    int useRow(int reg, int keep = -1) {
+        for (int ymm = FirstRowYmm; ymm < 16; ymm++) {
+            if (ymmRow[ymm] == reg) return ymm;
+        }
+        int ymm = takeYmm(keep, -1);
+        loadRow(ymm, reg);
+        ymmRow[ymm] = reg;
+        return ymm;
+    }
+    // Register to compute a new value of guest register reg in, leaving the operands a and b alone
+    int defRow(int reg, int a, int b) {
+        for (int ymm = FirstRowYmm; ymm < 16; ymm++) {
+            if (ymmRow[ymm] == reg) ymmRow[ymm] = -1;
+        }
+        int ymm = takeYmm(a, b);
+        ymmRow[ymm] = reg;
+        return ymm;
+    }
+
+    // One straight-line op across the lanes: rd row = rs1 row op operand
+    void emitLaneOp(const BlockOp &op) {
+        if (op.kind == OP_LI) {
+            int d = defRow(op.rd, -1, -1);
+            broadcast(d, op.imm);
+            storeRow(d, op.rd);
+            return;
+        }
+        bool imm = op.kind >= I_AND;
+        ALUSel sel = (ALUSel)(op.kind - (imm ? I_AND : R_AND));
+        bool shift = sel == ALUSel::SLL || sel == ALUSel::SRL || sel == ALUSel::SRA;
+        int a = useRow(op.rs1), b = 1;
+        if (imm) broadcast(1, shift ? op.imm & 31 : op.imm);
+        else {
+            b = useRow(op.rs2, a);
+            if (shift) { // AVX2 shifts do not wrap the count; RISC-V uses its low 5 bits
+                broadcast(2, 31);
+                vex(1, 1, 0xDB, 1, b, 2); // vpand ymm1, b, ymm2
+                b = 1;
+            }
+        }
+        int d = defRow(op.rd, a, b);
+        switch (sel) {
+            case ALUSel::SLL: vex(2, 1, 0x47, d, a, b); break; // vpsllvd d, a, b
+            case ALUSel::SRL: vex(2, 1, 0x45, d, a, b); break; // vpsrlvd d, a, b
+            case ALUSel::SRA: vex(2, 1, 0x46, d, a, b); break; // vpsravd d, a, b
+            case ALUSel::SLT: case ALUSel::SLTU:
+                if (sel == ALUSel::SLTU) flipSigns(a, b);
+                vex(1, 1, 0x66, d, b, a); // vpcmpgtd d, b, a: all ones where a < b
+                vex(1, 1, 0x72, 2, d, d); emit(31); // vpsrld d, d, 31
+                break;
+            default: {
+                // vpaddd, vpsubd, vpand, vpor, vpxor d, a, b
+                uint8_t opcode = sel == ALUSel::ADD ? 0xFE : sel == ALUSel::SUB ? 0xFA : sel == ALUSel::AND ? 0xDB
+                               : sel == ALUSel::OR ? 0xEB : 0xEF;
+                vex(1, 1, opcode, d, a, b);
+                break;
+            }
+        }
+        storeRow(d, op.rd);
     }
-};
 
-Utility utilities;
+    // Lane branch condition: leaves the taken lanes, out of laneMask, in eax and the flags of comparing
+    // them with laneMask, so je goes to the taken exit and a nonzero eax otherwise means the lanes split
+    void emitLaneBranch(const BlockOp &exit) {
+        int a = useRow(exit.rs1), b = useRow(exit.rs2, a);
+        if (exit.kind == EXIT_BEQ || exit.kind == EXIT_BNE) vex(1, 1, 0x76, 0, a, b); // vpcmpeqd ymm0, a, b
+        else {
+            if (exit.kind == EXIT_BLTU || exit.kind == EXIT_BGEU) flipSigns(a, b);
+            vex(1, 1, 0x66, 0, b, a); // vpcmpgtd ymm0, b, a: a < b
+        }
+        vex(1, 0, 0x50, 0, 0, 0); // vmovmskps eax, ymm0
+        if (exit.kind == EXIT_BNE || exit.kind == EXIT_BGE || exit.kind == EXIT_BGEU) emit({0xF7, 0xD0}); // not eax
+        emit(0x25); emit32(laneMask); // and eax, laneMask
+        emit(0x3D); emit32(laneMask); // cmp eax, laneMask
+    }
+};
+#else
+// Hosts other than x86-64 have no code generator; every block stays in the interpreter
+class JitCompiler {
+public:
+    typedef int (*Entry)(int32_t *regs, long long budget, long long *remaining);
+    explicit JitCompiler(unsigned = 0) {}
+    void *compile(const TranslatedBlock &, const vector<unique_ptr<TranslatedBlock>> &) { return nullptr; }
+    void reset() {}
+};
+#endif
 
 // Instruction Fetch/Decode structure
 class IFID {
 public:
-    string instr; // Instruction fetched
-    int CPC, NPC; // Current and next program counter
+    uint32_t instr = 0; // Instruction fetched
+    const DecodedInstr *decoded = nullptr; // Pre-decoded form of the instruction
+    int CPC, NPC; // Current and predicted next program counter
+    bool valid = false; // Holds a fetched instruction that has not been decoded yet
 };
 
 // Instruction Decode/Execute structure
@@ -98,10 +989,9 @@ class IDEX {
 public:
     class Control {
     public:
-        int RegRead, RegWrite, ALUSrc, ALUOp, Branch, Jump, MemRead, MemWrite, MemToReg;
-        // Set control signals based on opcode
-        void setControl(string opcode) {
-            CtrlWord signals = ControlUnit[opcode];
+        int RegRead, RegWrite, ALUSrc, ALUOp, Branch, Jump, MemRead, MemWrite, MemToReg, ALUSrcA;
+        // Set control signals from the pre-decoded control word
+        void setControl(const CtrlWord &signals) {
             RegRead = signals.RegRead;
             RegWrite = signals.RegWrite;
             ALUSrc = signals.ALUSrc;
@@ -111,10 +1001,14 @@ public:
             MemRead = signals.MemRead;
             MemWrite = signals.MemWrite;
             MemToReg = signals.MemToReg;
+            ALUSrcA = signals.ALUSrcA;
         }
     };
-    string imm1, imm2, func, rds, rs1, rs2, instr; // Instruction components
-    int JPC, CPC; // Jump and current program counter
+    uint32_t instr = 0; // Instruction being executed
+    const DecodedInstr *decoded = nullptr; // Pre-decoded form of the instruction
+    int rs1 = 0, rs2 = 0; // Source operand values
+    int JPC, CPC, NPC; // Jump, current and predicted next program counter
+    bool valid = false; // Holds a decoded instruction that has not been executed yet
     Control control; // Control signals
 };
 
@@ -123,7 +1017,7 @@ class EXMO {
 public:
     class Control {
     public:
-        int RegRead, RegWrite, ALUSrc, ALUOp, Branch, Jump, MemRead, MemWrite, MemToReg;
+        int RegRead, RegWrite, ALUSrc, ALUOp, Branch, Jump, MemRead, MemWrite, MemToReg, ALUSrcA;
         // Copy control signals from IDEX
         void copyFrom(IDEX &idex) {
             RegRead = idex.control.RegRead;
@@ -135,10 +1029,14 @@ public:
             MemRead = idex.control.MemRead;
             MemWrite = idex.control.MemWrite;
             MemToReg = idex.control.MemToReg;
+            ALUSrcA = idex.control.ALUSrcA;
         }
     };
-    string rds, rs2;    // Destination and source registers
-    int aluResult;      // ALU result
+    int rds = -1, rs2 = 0; // Destination register and second source value
+    int funct3 = 0; // Access width and signedness for loads and stores
+    int aluResult = 0;  // ALU result
+    bool valid = false; // False when the latch holds a bubble
+    bool cacheAccessed = false; // The data cache has already been charged for this access
     Control control;    // Control signals
 };
 
@@ -147,7 +1045,7 @@ class MOWB {
 public:
     class Control {
     public:
-        int RegRead, RegWrite, ALUSrc, ALUOp, Branch, Jump, MemRead, MemWrite, MemToReg;
+        int RegRead, RegWrite, ALUSrc, ALUOp, Branch, Jump, MemRead, MemWrite, MemToReg, ALUSrcA;
         // Copy control signals from EXMO
         void copyFrom(EXMO exmo) {
             RegRead = exmo.control.RegRead;
@@ -159,321 +1057,2012 @@ public:
             MemRead = exmo.control.MemRead;
             MemWrite = exmo.control.MemWrite;
             MemToReg = exmo.control.MemToReg;
+            ALUSrcA = exmo.control.ALUSrcA;
         }
     };
-    string rds; // Destination register
-    int aluResult, memoryData; // ALU result and memory data
+    int rds = -1; // Destination register
+    int aluResult = 0, memoryData = 0; // ALU result and memory data
+    bool valid = false; // False when the latch holds a bubble
     Control control; // Control signals
 };
 
-// Check for data and control hazards
-void checkHazards(string opcode, string rd, string rs1, string rs2) {
-    // Data Hazards
-    if (opcode == "0110011" || opcode == "1100011") {
-        if (rd == rs1 || rd == rs2) {
-            hazard[0] = true;
-            regLock[stoi(rd, NULL, 2)] = 1;
-        }
+// Execute the ALU operation based on control signals
+int ALUExec(ALUSel sel, int op1, int operand2) {
+    switch (sel) {
+        case ALUSel::AND: return op1 & operand2;
+        case ALUSel::OR: return op1 | operand2;
+        case ALUSel::ADD: return (int)((uint32_t)op1 + (uint32_t)operand2);
+        case ALUSel::SLL: return (int)((uint32_t)op1 << (operand2 & 31));
+        case ALUSel::XOR: return op1 ^ operand2;
+        case ALUSel::SRL: return (int)((uint32_t)op1 >> (operand2 & 31));
+        case ALUSel::SUB: return (int)((uint32_t)op1 - (uint32_t)operand2);
+        case ALUSel::SLT: return op1 < operand2;
+        case ALUSel::SLTU: return (uint32_t)op1 < (uint32_t)operand2;
+        case ALUSel::SRA: return op1 >> (operand2 & 31);
+        default:
+            cout << "Invalid ALU operation." << endl;
+            return -1;
     }
-    if (opcode == "0010011" || opcode == "0000011") {
-        if (rd == rs1) {
-            hazard[0] = true;
-            regLock[stoi(rd, NULL, 2)] = 1;
-        }
+}
+
+// True if the instruction reads reg in decode; these are the operands the hazard unit checks
+bool readsRegister(const DecodedInstr &instr, int reg) {
+    switch (instr.opcode) {
+        case 0b0110011: case 0b1100011: case 0b0100011: return reg == instr.rs1 || reg == instr.rs2; // R, B, S
+        case 0b0010011: case 0b0000011: case 0b1100111: return reg == instr.rs1; // I, L, JALR
+        default: return false;
     }
-    // Control Hazard
-    if (opcode == "1100011" || opcode == "1101111") {
-        hazard[1] = true;
+}
+
+// Resolve the branch condition from the comparison result
+bool branchTaken(int func, int aluResult) {
+    switch (func) {
+        case 0b000: return aluResult == 0; // BEQ
+        case 0b001: return aluResult != 0; // BNE
+        case 0b100: case 0b110: return aluResult != 0; // BLT, BLTU
+        case 0b101: case 0b111: return aluResult == 0; // BGE, BGEU
+        default: return false;
     }
 }
 
-// Fetch the instruction from memory
-void fetch(IFID &ifid) {
-    // Early return for blocking condition
-    if (hazard[0] || hazard[1]) {
-        return;
+// Output sink that formats into a large buffer and hands it to the stream in big writes,
+// so per-cycle dumps do not flush the terminal on every line
+class BufferedWriter {
+public:
+    explicit BufferedWriter(size_t capacity = 1 << 20) : out(stdout), buffer(capacity) {}
+    ~BufferedWriter() {
+        flush();
+        if (out != stdout) fclose(out);
     }
 
-    // Fetch the instruction
-    if (pc < instrNum * 4) {
-        int index = pc / 4;
-        ifid.instr = iMem[index];
-        ifid.CPC = pc;
-        pc = pc + 4;
-        states.fetch = true;
-    } else {
-        states.pc = false; // Halt the pipeline
+    // Redirect output to a file; returns false if it cannot be opened
+    bool open(const string &path) {
+        FILE *file = fopen(path.c_str(), "w");
+        if (!file) return false;
+        flush();
+        if (out != stdout) fclose(out);
+        out = file;
+        return true;
     }
-}
 
-// Decode the instruction and prepare for execution
-void decode(IDEX &idex, IFID &ifid, EXMO &exmo) {
-    // Early return for blocking condition
-    if (!states.pc || skip || hazard[0] || hazard[1]) {
-        if (skip) skip = false;
-        if (!states.pc) states.fetch = false;
-        return;
+    BufferedWriter &write(const char *data, size_t length) {
+        if (used + length > buffer.size()) {
+            flush();
+            if (length > buffer.size()) {
+                fwrite(data, 1, length, out);
+                return *this;
+            }
+        }
+        memcpy(&buffer[used], data, length);
+        used += length;
+        return *this;
+    }
+    BufferedWriter &operator<<(const char *text) { return write(text, strlen(text)); }
+    BufferedWriter &operator<<(const string &text) { return write(text.data(), text.size()); }
+    BufferedWriter &operator<<(char c) { return write(&c, 1); }
+    BufferedWriter &operator<<(long long value) {
+        if (buffer.size() - used < 24) flush(); // Room for any 64-bit integer
+        used = to_chars(&buffer[used], buffer.data() + buffer.size(), value).ptr - buffer.data();
+        return *this;
     }
+    BufferedWriter &operator<<(int value) { return *this << (long long)value; }
 
-    string instr = ifid.instr;
-    // Validate instruction length
-    if (instr.length() != 32) {
-        cout << "Invalid instruction length" << endl;
-        return;
+    // Hand everything buffered so far to the stream
+    void flush() {
+        if (used > 0) fwrite(buffer.data(), 1, used, out);
+        used = 0;
+        fflush(out);
     }
 
-    // Extract instruction components
-    idex.instr = instr;
-    idex.CPC = ifid.CPC;
-    idex.JPC = ifid.CPC + 4 * utilities.signExtend(instr.substr(0, 20));
-    
-    // Extract immediate values and control bits
-    idex.imm1 = instr.substr(0, 12);
-    idex.imm2 = instr.substr(0, 7) + instr.substr(20, 5);
-    idex.func = instr.substr(17, 3);
-    idex.rds = instr.substr(20, 5);
-    
-    // Set control signals and check for hazards
-    string opcode = instr.substr(25, 7);
-    idex.control.setControl(opcode);
-    checkHazards(opcode, exmo.rds, instr.substr(12, 5), instr.substr(7, 5));
-    
-    states.decode = true;
-}
+private:
+    FILE *out;
+    vector<char> buffer;
+    size_t used = 0;
+};
 
-// Determine the ALU control signal based on operation type
-string ALUCtrl(int ALUOp, const string& func, const string& func7) {
-    string ALUSel;
-
-    if (ALUOp == 0) ALUSel = "0010"; // ADD
-    else if (ALUOp == 1) {
-        if (func == "000" || func == "001") ALUSel = "0110"; // SUB
-        else ALUSel = "1111"; // Invalid
-    } 
-    else if (ALUOp == 10) {
-        if (func == "000") ALUSel = (func7 == "0000000") ? "0010" : "0110"; // ADD/SUB
-        else if (func == "001") ALUSel = "0011"; // SLL
-        else if (func == "111") ALUSel = "0000"; // AND
-        else if (func == "110") ALUSel = "0001"; // OR
-        else ALUSel = "1111";
-    } 
-    else if (ALUOp == 11) {
-        if (func == "000") ALUSel = "0010"; // ADD
-        else if (func == "010") ALUSel = "0111"; // SLT
-        else if (func == "100") ALUSel = "0011"; // SLL
-        else ALUSel = "1111";
-    } 
-    else ALUSel = "1111";
-    return ALUSel;
-}
+enum Verbosity { QUIET, FINAL_STATE, PER_CYCLE }; // How much machine state to print
 
-// Execute the ALU operation based on control signals
-int ALUExec(string ALUSel, string rs1, string rs2) {
-    // Convert binary string operands to integers
-    int op1 = stoi(rs1, nullptr, 2);
-    int operand2 = stoi(rs2, nullptr, 2);
-    int result;
-    if (ALUSel == "0000") result = op1 & operand2;      // AND
-    else if (ALUSel == "0001") result = op1 | operand2; // OR
-    else if (ALUSel == "0010") result = op1 + operand2; // ADD
-    else if (ALUSel == "0011") result = op1 << (operand2 & 31); // SLL
-    else if (ALUSel == "0110") result = op1 - operand2;         // SUB
-    else if (ALUSel == "0111") result = (op1 < operand2);       // SLT
-    else if (ALUSel == "1000") result = ((unsigned)op1 < (unsigned)operand2);  // SLTU
-    else if (ALUSel == "1111") {
-        cout << "Invalid ALU operation." << endl;
-        return -1;
-    }
-    return result;
-}
+// Direction predictors selectable for a simulation
+enum PredictorKind { PREDICT_STALL, PREDICT_STATIC, PREDICT_BHT, PREDICT_GSHARE };
+
+// A complete, self-contained CPU: program, memories, registers, pipeline latches and statistics.
+// Instances share no mutable state, so independent simulations can run on different threads.
+class Simulator {
+public:
+    // Microarchitecture options, applied on construction and on every reset
+    struct Config {
+        bool forwarding = true; // Bypass results into execute so only load-use dependencies stall
+        PredictorKind predictor = PREDICT_BHT; // PREDICT_STALL stalls fetch until each branch resolves
+        bool useICache = false, useDCache = false; // Without caches memory answers in a single cycle
+        Cache::Config iCacheConfig, dCacheConfig;
+        bool blockCache = true; // Run the functional model on translated, chained basic blocks
+        long long jitThreshold = 50; // Block executions before the JIT compiles it; 0 disables the JIT
+        bool threadedDispatch = true; // Interpreter dispatch: threaded code where supported, else one switch
+    };
 
-// Execute the instruction based on control signals
-void execute(EXMO &exmo, IDEX &idex) {
-    // Check if the fetch stage is active; if not, reset decode state and exit
-    if (!states.fetch) {
-        states.decode = false;
-        return;
+    Config config;
+    vector<uint32_t> iMem; // Instruction memory
+    vector<DecodedInstr> decodedMem; // Pre-decoded instruction memory, indexed by pc / 4
+    int instrNum = 0; // Number of instructions
+    int pc; // Program counter
+    GuestMemory dMem; // Data memory, byte-addressed
+    int GPR[32]; // General purpose registers
+
+    bitset<32> regLock; // Register lock status
+    bool skip; // Flag to skip execution
+    bool hazard[2]; // {data hazard stall, control hazard stall}
+    flags states; // Which pipeline stages are active
+    IFID ifid; // Pipeline latches
+    IDEX idex;
+    EXMO exmo;
+    MOWB mowb;
+
+    unique_ptr<BranchPredictor> predictor; // Direction predictor; null stalls fetch until each branch resolves
+    BranchTargetBuffer btb; // Targets for predicted-taken branches and jumps
+    unique_ptr<Cache> iCache, dCache; // Optional L1 caches
+    int iStall, dStall; // Remaining cycles fetch and the memory stage wait for a cache miss
+    int iPendingPC; // PC whose instruction cache miss is being (or has been) filled
+    bool memStalled; // The memory stage is waiting on the data cache this cycle
+    PerfCounters perf;
+    BufferedWriter *trace = nullptr; // Destination of the per-cycle dumps, none if null
+    vector<unique_ptr<TranslatedBlock>> blockCache; // Translations indexed by start pc / 4
+    unique_ptr<JitCompiler> jit; // Native code for hot blocks, created on first use
+
+    Simulator() {
+        reset();
+    }
+    explicit Simulator(const Config &cfg) : config(cfg) {
+        reset();
     }
-    if (hazard[0]) return;  // Return if there is a data hazard
-    if (skip) return; // Return if execution should be skipped
 
-    string instr = idex.instr; // Get the instruction from the decode stage
-    if (idex.control.RegRead) { // Read the first source register if RegRead control signal is active
-        idex.rs1 = utilities.toBin(GPR[utilities.toDec(instr.substr(12, 5))]);
+    // Load a program into instruction memory and return to the power-on state
+    void load(const vector<uint32_t> &program) {
+        iMem = program;
+        instrNum = iMem.size();
+        predecode();
+        reset();
     }
-    // Determine the second source register or immediate value based on ALUSrc control signal
-    if (idex.control.ALUSrc && (instr.substr(25, 7) == "0010011" || instr.substr(25, 7) == "0000011")) {
-        if (idex.control.RegRead) {
-            idex.rs2 = idex.imm1; // Use immediate value
+
+    // Return to the power-on state, keeping the loaded program
+    void reset() {
+        pc = 0;
+        dMem = GuestMemory();
+        fill(begin(GPR), end(GPR), 0);
+        regLock.reset();
+        skip = false;
+        hazard[0] = hazard[1] = false;
+        states = flags();
+        ifid = IFID();
+        idex = IDEX();
+        exmo = EXMO();
+        mowb = MOWB();
+
+        switch (config.predictor) {
+            case PREDICT_STALL: predictor.reset(); break;
+            case PREDICT_STATIC: predictor.reset(new StaticNotTaken()); break;
+            case PREDICT_BHT: predictor.reset(new BimodalPredictor()); break;
+            case PREDICT_GSHARE: predictor.reset(new GsharePredictor()); break;
         }
-    } else {
-        if (idex.control.RegRead) idex.rs2 = utilities.toBin(GPR[utilities.toDec(instr.substr(7, 5))]); // Use second source register
+        btb = BranchTargetBuffer();
+        iCache.reset(config.useICache ? new Cache(config.iCacheConfig) : nullptr);
+        dCache.reset(config.useDCache ? new Cache(config.dCacheConfig) : nullptr);
+        iStall = dStall = 0;
+        iPendingPC = -1;
+        memStalled = false;
+        perf = PerfCounters();
     }
 
-    // Get the ALU control signal based on the operation type
-    string aluControl = ALUCtrl(idex.control.ALUOp, idex.func, idex.instr.substr(0, 7));
-    string opcode = idex.instr.substr(25, 7); // Extract opcode from instruction
-    // Execute ALU operation based on opcode
-    if (opcode == "0100011" || opcode == "1100011") exmo.aluResult = ALUExec(aluControl, idex.rs1, idex.imm2);
-    else exmo.aluResult = ALUExec(aluControl, idex.rs1, idex.rs2);
-    
-    int zeroFlag = (idex.rs1 == idex.rs2); // Check if the two source registers are equal
-    exmo.control.copyFrom(idex); // Copy control signals to the execute stage
+    // True while there are instructions left to fetch or still in flight
+    bool running() const {
+        return pc < instrNum * 4 || states.pc || states.fetch || states.decode || states.execute || states.memory;
+    }
 
-    // Handle branch instruction
-    if (idex.control.Branch) {
-        if (zeroFlag) pc = (utilities.toDec(idex.imm2) * 4 + idex.CPC); // Update program counter if branch is taken
-        if (hazard[1]) skip = true; // Set skip flag if there is a control hazard
-        hazard[1] = false; // Reset control hazard flag
+    // Advance the pipeline one step, evaluating the stages back to front; returns false once it has drained
+    bool step() {
+        if (!running()) return false;
+        if (states.memory) {
+            writeback(mowb);
+            if (trace) dumpCycle(*trace);
+        }
+        if (states.execute) memOperation(mowb, exmo);
+        if (states.decode) execute(exmo, idex);
+        if (states.fetch) decode(idex, ifid, exmo);
+        if (states.pc) fetch(ifid);
+        return true;
     }
 
-    // Handle jump instruction
-    if (idex.control.Jump) {
-        pc = idex.JPC; // Update program counter to jump address
-        if (hazard[1]) skip = true; // Set skip flag if there is a control hazard
-        hazard[1] = false; // Reset control hazard flag
+    // Step until the pipeline drains or maxCycles more cycles complete; returns the cycles run
+    long long run(long long maxCycles = LLONG_MAX) {
+        long long start = perf.cycles;
+        while (perf.cycles - start < maxCycles && step()) {}
+        return perf.cycles - start;
     }
 
-    exmo.rds = idex.rds; // Set destination register
-    exmo.rs2 = idex.rs2; // Set second source register
-    states.execute = true; // Mark execute stage as active
-}
+    // Pre-decode the whole instruction memory once before simulation starts
+    void predecode() {
+        decodedMem.clear();
+        decodedMem.reserve(iMem.size());
+        for (uint32_t instr : iMem) {
+            decodedMem.push_back(decodeInstr(instr));
+        }
+        invalidateBlocks();
+    }
 
-// Perform memory operations based on control signals
-void memOperation(MOWB &mowb, EXMO &exmo) {
-    // Check if the decode stage is active; if not, reset memory state and exit
-    if (!states.decode) {
-        states.execute = false;
-        return;
+    // Replace one instruction word. Instruction and data memory are separate, so guest stores can
+    // never modify code; this is the only path that does, and it drops every translation.
+    void writeInstruction(int index, uint32_t word) {
+        iMem.at(index) = word;
+        decodedMem[index] = decodeInstr(word);
+        invalidateBlocks();
     }
 
-    // Perform memory write operation if enabled
-    if (exmo.control.MemWrite) dMem[exmo.aluResult] = utilities.toDec(exmo.rs2);
-    // Perform memory read operation if enabled
-    if (exmo.control.MemRead) mowb.memoryData = dMem[exmo.aluResult];
+    // Forget all translated blocks, and with them every chain pointer between blocks
+    void invalidateBlocks() {
+        blockCache.clear();
+        blockCache.resize(iMem.size());
+        if (jit) jit->reset();
+    }
 
-    // Store the ALU result and copy control signals for the next stage
-    mowb.aluResult = exmo.aluResult;
-    mowb.control.copyFrom(exmo);
-    mowb.rds = exmo.rds;
-    states.memory = true; // Indicate that the memory stage is active
-}
+    // Translate the block starting at pc into the cache
+    TranslatedBlock *cacheBlock(int pc) {
+        TranslatedBlock *block = translateBlock(decodedMem, pc);
+        blockCache[pc >> 2].reset(block);
+        return block;
+    }
 
-// Write back the results to the register file
-void writeback(MOWB &mowb) {
-    // Check if the execute stage is active; if not, reset memory state and exit
-    if (!states.execute) {
-        states.memory = false;
-        return;
-    }
-
-    bool unlockRegister = false; // Flag to determine if the register should be unlocked
-    // Check if a register write operation is needed
-    if (mowb.control.RegWrite) {
-        // If writing from memory, store the memory data in the register
-        if (mowb.control.MemToReg) {
-            GPR[utilities.toDec(mowb.rds)] = mowb.memoryData;
-            // Check if the register is locked
-            if (regLock[stoi(mowb.rds, NULL, 2)] == 1) unlockRegister = true;
-        } else {
-            // Otherwise, write the ALU result to the register
-            GPR[utilities.toDec(mowb.rds)] = mowb.aluResult;
-            // Check if the register is locked
-            if (regLock[stoi(mowb.rds, NULL, 2)] == 1) unlockRegister = true;
+    // Functional simulation on translated basic blocks. A block runs its ops back to back, then follows
+    // its chained successor directly; only unchained or computed (JALR) exits go back to the cache lookup.
+    // With threaded set, and GCC's labels-as-values available, each op handler jumps straight to the next
+    // op's handler and the last one to the block's exit handler, as in interpret(); otherwise they share a switch.
+    // The last few instructions of an instruction budget are left to the per-instruction interpreter.
+    // A memory fault leaves pc at the faulting instruction, with the instructions before it committed.
+    template <bool threaded>
+    long long runBlocks(long long maxInstructions) {
+        const unsigned limit = (unsigned)instrNum * 4;
+        const bool useJit = config.jitThreshold > 0;
+        int *regs = GPR;
+        int curPC = pc;
+        long long retired = 0;
+        TranslatedBlock *block = nullptr;
+        const BlockOp *op = nullptr, *opsEnd = nullptr;
+        bool taken = false;
+
+#if defined(__GNUC__)
+        static const void *const handlers[EXIT_FALLTHROUGH + 1] = {
+            &&op_r_and, &&op_r_or, &&op_r_add, &&op_r_sll, &&op_r_xor, &&op_r_srl, &&op_r_sub, &&op_r_slt, &&op_r_sltu, &&op_r_sra,
+            &&op_i_and, &&op_i_or, &&op_i_add, &&op_i_sll, &&op_i_xor, &&op_i_srl, &&op_i_sub, &&op_i_slt, &&op_i_sltu, &&op_i_sra,
+            &&op_load, &&op_load_x0, &&op_store, &&op_li, &&op_generic,
+            &&exit_beq, &&exit_bne, &&exit_blt, &&exit_bge, &&exit_bltu, &&exit_bgeu, &&exit_jal, &&exit_jalr,
+            &&exit_fallthrough,
+        };
+#define HANDLER(name) name:
+#define DISPATCH() \
+        do { \
+            if (!threaded) goto dispatch; \
+            goto *handlers[op != opsEnd ? op->kind : block->exit.kind]; \
+        } while (0)
+#else
+#define HANDLER(name)
+#define DISPATCH() goto dispatch
+#endif
+#define NEXT() do { op++; DISPATCH(); } while (0)
+#define A regs[op->rs1]
+#define B regs[op->rs2]
+#define RD regs[op->rd]
+#define EXIT_A regs[block->exit.rs1]
+#define EXIT_B regs[block->exit.rs2]
+#define U(x) ((uint32_t)(x))
+
+        try { // Labels stay inside the try block, so every jump between handlers is local to it
+    next_block:
+            if ((unsigned)curPC >= limit) goto done;
+            if (!block) {
+                block = blockCache[curPC >> 2].get();
+                if (!block) block = cacheBlock(curPC);
+            }
+            if (block->length > maxInstructions - retired) goto done;
+
+            // Hot blocks move to native code, which runs until it reaches a block that is not compiled
+            if (useJit && !block->native && ++block->execCount == config.jitThreshold) {
+                if (!jit) jit.reset(new JitCompiler());
+                block->native = jit->compile(*block, blockCache);
+            }
+            if (block->native) {
+                long long budget = maxInstructions - retired, remaining;
+                curPC = ((JitCompiler::Entry)block->native)(regs, budget, &remaining);
+                retired += budget - remaining;
+                block = nullptr;
+                goto next_block;
+            }
+
+            op = block->ops.data();
+            opsEnd = op + block->ops.size();
+            DISPATCH();
+    dispatch:
+            switch (op != opsEnd ? op->kind : block->exit.kind) {
+                case R_AND: HANDLER(op_r_and) RD = A & B; NEXT();
+                case R_OR: HANDLER(op_r_or) RD = A | B; NEXT();
+                case R_ADD: HANDLER(op_r_add) RD = (int)(U(A) + U(B)); NEXT();
+                case R_SLL: HANDLER(op_r_sll) RD = (int)(U(A) << (B & 31)); NEXT();
+                case R_XOR: HANDLER(op_r_xor) RD = A ^ B; NEXT();
+                case R_SRL: HANDLER(op_r_srl) RD = (int)(U(A) >> (B & 31)); NEXT();
+                case R_SUB: HANDLER(op_r_sub) RD = (int)(U(A) - U(B)); NEXT();
+                case R_SLT: HANDLER(op_r_slt) RD = A < B; NEXT();
+                case R_SLTU: HANDLER(op_r_sltu) RD = U(A) < U(B); NEXT();
+                case R_SRA: HANDLER(op_r_sra) RD = A >> (B & 31); NEXT();
+
+                case I_AND: HANDLER(op_i_and) RD = A & op->imm; NEXT();
+                case I_OR: HANDLER(op_i_or) RD = A | op->imm; NEXT();
+                case I_ADD: HANDLER(op_i_add) RD = (int)(U(A) + U(op->imm)); NEXT();
+                case I_SLL: HANDLER(op_i_sll) RD = (int)(U(A) << (op->imm & 31)); NEXT();
+                case I_XOR: HANDLER(op_i_xor) RD = A ^ op->imm; NEXT();
+                case I_SRL: HANDLER(op_i_srl) RD = (int)(U(A) >> (op->imm & 31)); NEXT();
+                case I_SUB: HANDLER(op_i_sub) RD = (int)(U(A) - U(op->imm)); NEXT();
+                case I_SLT: HANDLER(op_i_slt) RD = A < op->imm; NEXT();
+                case I_SLTU: HANDLER(op_i_sltu) RD = U(A) < U(op->imm); NEXT();
+                case I_SRA: HANDLER(op_i_sra) RD = A >> (op->imm & 31); NEXT();
+
+                case OP_LOAD: HANDLER(op_load) RD = dMem.load(A + op->imm, op->rs2); NEXT();
+                case OP_LOAD_X0: HANDLER(op_load_x0) dMem.load(A + op->imm, op->rs2); NEXT();
+                case OP_STORE: HANDLER(op_store) dMem.store(A + op->imm, op->rs2, RD); NEXT();
+                case OP_LI: HANDLER(op_li) RD = op->imm; NEXT();
+                case OP_GENERIC: HANDLER(op_generic) RD = ALUExec(op->aluSel, A, B); NEXT(); // Invalid selections report and yield -1
+
+                // Resolve the exit, then follow (or create) the chain link for it
+                case EXIT_BEQ: HANDLER(exit_beq) taken = EXIT_A == EXIT_B; goto follow;
+                case EXIT_BNE: HANDLER(exit_bne) taken = EXIT_A != EXIT_B; goto follow;
+                case EXIT_BLT: HANDLER(exit_blt) taken = EXIT_A < EXIT_B; goto follow;
+                case EXIT_BGE: HANDLER(exit_bge) taken = EXIT_A >= EXIT_B; goto follow;
+                case EXIT_BLTU: HANDLER(exit_bltu) taken = U(EXIT_A) < U(EXIT_B); goto follow;
+                case EXIT_BGEU: HANDLER(exit_bgeu) taken = U(EXIT_A) >= U(EXIT_B); goto follow;
+                case EXIT_JAL: HANDLER(exit_jal)
+                    if (block->exit.rd) regs[block->exit.rd] = block->fallthroughPC;
+                    taken = true;
+                    goto follow;
+                case EXIT_JALR: HANDLER(exit_jalr)
+                    curPC = (EXIT_A + block->exit.imm) & ~1; // rd may equal rs1
+                    if (block->exit.rd) regs[block->exit.rd] = block->fallthroughPC;
+                    retired += block->length;
+                    block = nullptr;
+                    goto next_block;
+                case EXIT_FALLTHROUGH: HANDLER(exit_fallthrough) taken = false; goto follow;
+            }
+    follow:
+            retired += block->length;
+            curPC = taken ? block->takenPC : block->fallthroughPC;
+            {
+                TranslatedBlock *&link = taken ? block->taken : block->fallthrough;
+                if (!link && (unsigned)curPC < limit) {
+                    link = blockCache[curPC >> 2].get();
+                    if (!link) link = cacheBlock(curPC);
+                }
+                block = link;
+            }
+            // With the JIT off, a chained successor that fits the budget starts its ops straight away
+            if (!useJit && block && block->length <= maxInstructions - retired) {
+                op = block->ops.data();
+                opsEnd = op + block->ops.size();
+                DISPATCH();
+            }
+            goto next_block;
+        } catch (const MemoryFault &) {
+            pc = block->opPCs[op - block->ops.data()];
+            perf.functionalInstret += retired + op->offset;
+            throw;
         }
-    }
 
-    // If the register was unlocked, reset hazard and skip flags, and unlock the register
-    if (unlockRegister) {
-        hazard[0] = false;
-        skip = true;
-        regLock[stoi(mowb.rds, NULL, 2)] = 0;
+#undef HANDLER
+#undef DISPATCH
+#undef NEXT
+#undef A
+#undef B
+#undef RD
+#undef EXIT_A
+#undef EXIT_B
+#undef U
+    done:
+        pc = curPC;
+        perf.functionalInstret += retired;
+        if (retired < maxInstructions && (unsigned)pc < limit) retired += runFunctional(maxInstructions - retired, false);
+        return retired;
     }
-}
 
-int main() {    
-    vector<string> machineCode = {
-        // // Sum of 10 numbers
-        // "00000000101100110010001010000011",
-        // "00000000000100001000000010010011",
-        // "00000000000100101000001010010011",
-        // "00000000010100001000001001100011",
-        // "00000000000100010000000100110011",
-        // "00000000000100001000000010010011",
-        // "11111111111111111101000111101111",
-        // "00000000001011111010000000100011"
-
-        // Fibonacci Sequence
-        "00000000000000000010000010000011",
-        "00000000000000001000010111100011",
-        "00000000000100011000000110010011",
-        "00000000001100001000010011100011",
-        "00000000000100000000000100010011",
-        "00000000000100100000001000010011",
-        "00000000000100010000001101100011",
-        "00000000010100100000000110110011",
-        "00000000000000100000001010110011",
-        "00000000000000011000001000110011",
-        "00000000000100010000000100010011",
-        "11111111111111111011001101101111",
-        "00000000001100000010000010100011"
-    };
-    
-    IFID ifid;
-    IDEX idex;
-    EXMO exmo;
-    MOWB mowb;
 
-    iMem = machineCode;
-    pc = 0;
-    dMem[0] = 10;
-    dMem[1] = 1;
-    dMem[11] = 10;
-    int n = machineCode.size();
-    instrNum = n;
+    // Check for data and control hazards against the preceding instruction in EXMO
+    void checkHazards(const DecodedInstr &instr, const EXMO &exmo) {
+        // Only a preceding instruction that writes a register other than x0 can cause a data hazard.
+        // With forwarding its ALU result is bypassed, so only a load (data ready after MEM) stalls.
+        int rd = (exmo.valid && exmo.control.RegWrite && exmo.rds != 0) ? exmo.rds : -1;
+        if (config.forwarding && !exmo.control.MemRead) rd = -1;
+        // Data Hazards
+        if (rd >= 0 && readsRegister(instr, rd)) {
+            hazard[0] = true;
+            regLock[rd] = 1;
+        }
+        // Control Hazard: without a predictor, fetch waits for every branch and jump to resolve
+        if (!predictor && (instr.control.Branch || instr.control.Jump)) {
+            hazard[1] = true;
+        }
+        if (hazard[0]) perf.dataHazards++;
+    }
 
-    int cycleCount = 1;
-    while (pc < n * 4 || states.pc || states.fetch || states.decode || states.execute || states.memory) {
-        if (states.memory) {
-            writeback(mowb);
-            cout << endl;
-            // cout << "Stage 5 (writeBack)" << endl;
-            cout << "Cycle " << cycleCount << " Complete." << endl;
-            for (int i = 0; i < 8; i++) {
-                cout << " R[" << i << "]: " << GPR[i];
-            }
-            cout << endl;
-            cout << "dMem[0]: " << dMem[0] << ", dMem[1]: " << dMem[1] << endl;
-            cycleCount++;
-        }
-        if (states.execute) {
-            memOperation(mowb, exmo);
-            // cout << endl;
-            // cout << "Stage 4 (memOperation)" << endl;
-        }
-        if (states.decode) {
-            execute(exmo, idex);
-            // cout << endl;
-            // cout << "Stage 3 (execute)" << endl;
-        }
-        if (states.fetch) {
-            decode(idex, ifid, exmo);
-            // cout << endl;
-            // cout << "Stage 2 (decode)" << endl;
-        }
-        if (states.pc) {
-            fetch(ifid);
-            // cout << endl;
-            // cout << "Stage 1 (fetch)" << endl
-            // cout << "Instruction: " << pc / 4 << endl;
-        }
-    }
-    cout << endl;
-    cout << "Execution Complete." << endl;
-    for (int i = 0; i < 8; i++) {
-        cout << "R[" << i << "]: " << GPR[i] << endl;
-    }
-    cout << "dMem[0] " << dMem[0] << endl;
-    cout << "dMem[1] " << dMem[1] << endl;
+    // Fetch the instruction from memory
+    void fetch(IFID &ifid) {
+        // Wait for an instruction cache miss to be filled
+        if (iStall > 0) {
+            iStall--;
+            perf.icacheStalls++;
+            return;
+        }
+        // Early return for blocking condition
+        if (hazard[0] || hazard[1] || memStalled) {
+            return;
+        }
+
+        // Fetch the instruction
+        if ((unsigned)pc < (unsigned)instrNum * 4) {
+            // Charge the instruction cache on the first attempt to fetch this PC
+            if (iCache && iPendingPC != pc) {
+                iStall = iCache->access(pc, false);
+                if (iStall > 0) {
+                    iPendingPC = pc;
+                    iStall--;
+                    perf.icacheStalls++;
+                    return;
+                }
+            }
+            iPendingPC = -1;
+
+            int index = pc / 4;
+            ifid.instr = iMem[index];
+            ifid.decoded = &decodedMem[index];
+            ifid.CPC = pc;
+            ifid.NPC = pc + 4;
+            // Follow the BTB target of a known jump, or of a branch the predictor expects to be taken
+            if (predictor) {
+                const auto *entry = btb.lookup(pc);
+                if (entry && (!entry->conditional || predictor->predict(pc))) ifid.NPC = entry->target;
+            }
+            pc = ifid.NPC;
+            ifid.valid = true;
+            states.fetch = true;
+        } else {
+            states.pc = false; // Halt the pipeline
+        }
+    }
+
+    // Decode the instruction and prepare for execution
+    void decode(IDEX &idex, IFID &ifid, EXMO &exmo) {
+        if (memStalled) return; // The memory stage is waiting on the data cache
+        // Early return for blocking condition
+        if (!states.pc || skip || hazard[0] || hazard[1] || !ifid.valid) {
+            if (skip) {
+                skip = false;
+                ifid.valid = false; // Squash whatever fetch delivered
+            }
+            if (!states.pc) states.fetch = false;
+            return;
+        }
+
+        // Latch the pre-decoded instruction
+        const DecodedInstr &instr = *ifid.decoded;
+        idex.instr = ifid.instr;
+        idex.decoded = ifid.decoded;
+        idex.CPC = ifid.CPC;
+        idex.NPC = ifid.NPC;
+        idex.JPC = (int)((uint32_t)ifid.CPC + 4u * (uint32_t)instr.imm); // Wraps for U-type immediates, unused there
+        idex.valid = true;
+        ifid.valid = false;
+    
+        // Set control signals and check for hazards
+        idex.control.setControl(instr.control);
+        checkHazards(instr, exmo);
+    
+        states.decode = true;
+    }
+
+    // Forwarding unit: read a source register, bypassing the ALU result held in EXMO when it is newer.
+    // Results in MOWB need no bypass path: writeback runs before execute in every simulated cycle.
+    int readOperand(int reg, const EXMO &exmo) {
+        if (config.forwarding && exmo.valid && exmo.control.RegWrite && !exmo.control.MemRead && reg != 0 && exmo.rds == reg) {
+            return exmo.aluResult;
+        }
+        return GPR[reg];
+    }
+
+    // Execute the instruction based on control signals
+    void execute(EXMO &exmo, IDEX &idex) {
+        if (memStalled) return; // Hold EXMO while the memory stage waits on the data cache
+        // Check if the fetch stage is active; if not, reset decode state and exit
+        if (!states.fetch) {
+            states.decode = false;
+            exmo.valid = false;
+            return;
+        }
+        // Insert a bubble on a data hazard stall, when execution should be skipped,
+        // or when the instruction in IDEX was already executed
+        if (hazard[0] || skip || !idex.valid) {
+            if (hazard[0]) perf.dataStalls++;
+            exmo.valid = false;
+            return;
+        }
+
+        const DecodedInstr &instr = *idex.decoded; // Get the instruction from the decode stage
+        idex.valid = false; // Consume the instruction so it executes exactly once
+        if (idex.control.RegRead) { // Read the source registers through the forwarding unit if RegRead is active
+            idex.rs1 = readOperand(instr.rs1, exmo);
+            idex.rs2 = readOperand(instr.rs2, exmo);
+        }
+        // Select the ALU operands based on ALUSrcA and ALUSrc control signals
+        int operand1 = (idex.control.ALUSrcA == 0) ? idex.rs1 : (idex.control.ALUSrcA == 1) ? idex.CPC : 0;
+        int operand2 = (idex.control.ALUSrc == 0) ? idex.rs2 : (idex.control.ALUSrc == 1) ? instr.imm : 4;
+
+        // Get the ALU control signal based on the operation type and execute it
+        ALUSel aluControl = ALUCtrl(idex.control.ALUOp, instr.funct3, instr.funct7);
+        exmo.aluResult = ALUExec(aluControl, operand1, operand2);
+        exmo.control.copyFrom(idex); // Copy control signals to the execute stage
+
+        // Resolve the next program counter
+        int nextPC = idex.CPC + 4;
+        if (idex.control.Branch) {
+            bool taken = branchTaken(instr.funct3, exmo.aluResult);
+            perf.branches++;
+            if (taken) {
+                nextPC = instr.imm * 4 + idex.CPC;
+                perf.branchesTaken++;
+            }
+            if (predictor) {
+                predictor->update(idex.CPC, taken);
+                btb.update(idex.CPC, instr.imm * 4 + idex.CPC, true);
+            }
+        }
+        if (idex.control.Jump) {
+            perf.jumps++;
+            // PC-relative (JAL) or register-indirect (JALR) jump address
+            nextPC = (idex.control.Jump == 2) ? ((idex.rs1 + instr.imm) & ~1) : idex.JPC;
+            if (predictor) btb.update(idex.CPC, nextPC, false);
+        }
+
+        if (!predictor) {
+            // Handle branch and jump instructions once fetch has been stalled for them
+            if (idex.control.Branch || idex.control.Jump) {
+                pc = nextPC; // Update program counter
+                if (hazard[1]) { // Set skip flag if there is a control hazard
+                    skip = true;
+                    perf.controlStalls++;
+                }
+                hazard[1] = false; // Reset control hazard flag
+            }
+        } else {
+            // On a misprediction, squash the wrong-path instruction in IFID and redirect fetch
+            if (nextPC != idex.NPC) {
+                perf.mispredictions++;
+                perf.flushes++;
+                pc = nextPC;
+                iStall = 0; // Abandon a wrong-path instruction cache miss
+                skip = true;
+                states.pc = true; // Fetch may have run off the end of the program on the wrong path
+            }
+        }
+
+        exmo.rds = instr.rd; // Set destination register
+        exmo.rs2 = idex.rs2; // Set second source register
+        exmo.funct3 = instr.funct3;
+        exmo.valid = true;
+        exmo.cacheAccessed = false;
+        states.execute = true; // Mark execute stage as active
+    }
+
+    // Perform memory operations based on control signals
+    void memOperation(MOWB &mowb, EXMO &exmo) {
+        memStalled = false;
+        // Check if the decode stage is active; if not, reset memory state and exit
+        if (!states.decode) {
+            states.execute = false;
+            return;
+        }
+
+        states.memory = true; // Indicate that the memory stage is active
+        mowb.valid = exmo.valid;
+        if (!exmo.valid) return; // Pass the bubble on to writeback
+
+        // Charge the data cache the first time the access is seen, then wait out the miss
+        if (dCache && (exmo.control.MemRead || exmo.control.MemWrite)) {
+            if (!exmo.cacheAccessed) {
+                exmo.cacheAccessed = true;
+                dStall = dCache->access(exmo.aluResult, exmo.control.MemWrite);
+            }
+            if (dStall > 0) {
+                dStall--;
+                perf.dcacheStalls++;
+                memStalled = true;
+                mowb.valid = false;
+                return;
+            }
+        }
+
+        // Perform memory write operation if enabled
+        if (exmo.control.MemWrite) {
+            dMem.store(exmo.aluResult, exmo.funct3, exmo.rs2);
+            perf.stores++;
+        }
+        // Perform memory read operation if enabled
+        if (exmo.control.MemRead) {
+            mowb.memoryData = dMem.load(exmo.aluResult, exmo.funct3);
+            perf.loads++;
+            // With forwarding, a load-use stall ends once the data is read, reaching execute through writeback
+            if (config.forwarding && exmo.rds != 0 && regLock[exmo.rds] == 1) {
+                hazard[0] = false;
+                skip = true;
+                regLock[exmo.rds] = 0;
+                perf.dataStalls++; // The cycle execute skips while the stall unwinds
+            }
+        }
+
+        // Store the ALU result and copy control signals for the next stage
+        mowb.aluResult = exmo.aluResult;
+        mowb.control.copyFrom(exmo);
+        mowb.rds = exmo.rds;
+    }
+
+    // Write back the results to the register file
+    void writeback(MOWB &mowb) {
+        perf.cycles++;
+        // Check if the execute stage is active; if not, reset memory state and exit
+        if (!states.execute) {
+            states.memory = false;
+            return;
+        }
+        if (!mowb.valid) return; // Nothing to write back for a bubble
+        perf.instret++;
+
+        bool unlockRegister = false; // Flag to determine if the register should be unlocked
+        // Check if a register write operation is needed
+        if (mowb.control.RegWrite && mowb.rds != 0) { // x0 is hardwired to zero
+            // If writing from memory, store the memory data in the register
+            if (mowb.control.MemToReg) {
+                GPR[mowb.rds] = mowb.memoryData;
+                // Check if the register is locked
+                if (regLock[mowb.rds] == 1) unlockRegister = true;
+            } else {
+                // Otherwise, write the ALU result to the register
+                GPR[mowb.rds] = mowb.aluResult;
+                // Check if the register is locked
+                if (regLock[mowb.rds] == 1) unlockRegister = true;
+            }
+        }
+
+        // If the register was unlocked, reset hazard and skip flags, and unlock the register
+        if (unlockRegister) {
+            hazard[0] = false;
+            skip = true;
+            regLock[mowb.rds] = 0;
+            perf.dataStalls++; // The cycle execute skips while the stall unwinds
+        }
+    }
+
+    // Functional simulation: commit one pre-decoded instruction per step without pipeline timing
+    // Stops when the PC leaves the program or after maxInstructions; returns the number retired.
+    // Hands over to the basic-block translator when it is enabled.
+    long long runFunctional(long long maxInstructions = LLONG_MAX, bool useBlocks = true) {
+        if (useBlocks && config.blockCache) {
+            return config.threadedDispatch ? runBlocks<true>(maxInstructions) : runBlocks<false>(maxInstructions);
+        }
+        long long retired = config.threadedDispatch ? interpret<true>(maxInstructions) : interpret<false>(maxInstructions);
+        perf.functionalInstret += retired;
+        return retired;
+    }
+
+    // Execute one instruction the way the original decoder does; returns the next PC.
+    // Used by EXEC_GENERIC for encodings the specialised handlers leave out.
+    int executeGeneric(const DecodedInstr &instr, int curPC) {
+        int rs1 = GPR[instr.rs1];
+        int result = 0;
+        int nextPC = curPC + 4;
+        switch (instr.opcode) {
+            case 0b0110011: result = ALUExec(instr.aluSel, rs1, GPR[instr.rs2]); break; // R-Type
+            case 0b0010011: result = ALUExec(instr.aluSel, rs1, instr.imm); break; // I-Type
+            case 0b0000011: result = dMem.load(rs1 + instr.imm, instr.funct3); break; // L-Type
+            case 0b0100011: dMem.store(rs1 + instr.imm, instr.funct3, GPR[instr.rs2]); break; // S-Type
+            case 0b1100011: // B-Type
+                if (branchTaken(instr.funct3, ALUExec(instr.aluSel, rs1, GPR[instr.rs2]))) nextPC = curPC + instr.imm * 4;
+                break;
+            case 0b0110111: result = instr.imm; break; // LUI
+            case 0b0010111: result = curPC + instr.imm; break; // AUIPC
+            case 0b1101111: result = curPC + 4; nextPC = curPC + instr.imm * 4; break; // JAL
+            case 0b1100111: result = curPC + 4; nextPC = (rs1 + instr.imm) & ~1; break; // JALR
+        }
+        if (instr.control.RegWrite && instr.rd != 0) GPR[instr.rd] = result;
+        return nextPC;
+    }
+
+    // Per-instruction interpreter with one handler per ExecOp. With threaded set, and GCC's labels-as-values
+    // available, every handler ends in its own indirect jump to the next handler (threaded code), which the host
+    // predicts per call site. Otherwise all handlers return to a single switch.
+    template <bool threaded>
+    long long interpret(long long maxInstructions) {
+        const DecodedInstr *program = decodedMem.data();
+        const DecodedInstr *instr;
+        unsigned limit = (unsigned)instrNum * 4;
+        int curPC = pc; // Keep the PC in a local so it can live in a host register
+        long long retired = 0;
+        uint32_t address;
+
+#if defined(__GNUC__)
+        static const void *const handlers[EXEC_COUNT] = {
+            &&exec_add, &&exec_sub, &&exec_and, &&exec_or, &&exec_xor, &&exec_sll, &&exec_srl, &&exec_sra, &&exec_slt, &&exec_sltu,
+            &&exec_addi, &&exec_andi, &&exec_ori, &&exec_xori, &&exec_slli, &&exec_srli, &&exec_srai, &&exec_slti, &&exec_sltiu,
+            &&exec_lb, &&exec_lh, &&exec_lw, &&exec_lbu, &&exec_lhu, &&exec_sb, &&exec_sh, &&exec_sw,
+            &&exec_beq, &&exec_bne, &&exec_blt, &&exec_bge, &&exec_bltu, &&exec_bgeu,
+            &&exec_lui, &&exec_auipc, &&exec_jal, &&exec_j, &&exec_jalr, &&exec_jr,
+            &&exec_nop, &&exec_generic,
+        };
+#define HANDLER(name) exec_##name:
+#define NEXT(nextPC) \
+        do { \
+            curPC = (nextPC); \
+            retired++; \
+            if (!threaded) goto dispatch; \
+            if (retired >= maxInstructions || (unsigned)curPC >= limit) goto done; \
+            instr = &program[curPC >> 2]; \
+            goto *handlers[instr->exec]; \
+        } while (0)
+#else
+#define HANDLER(name)
+#define NEXT(nextPC) do { curPC = (nextPC); retired++; goto dispatch; } while (0)
+#endif
+#define RS1 GPR[instr->rs1]
+#define RS2 GPR[instr->rs2]
+#define RD GPR[instr->rd]
+#define U(x) ((uint32_t)(x))
+
+        try { // Labels stay inside the try block, so every jump between handlers is local to it
+    dispatch:
+            if (retired >= maxInstructions || (unsigned)curPC >= limit) goto done;
+            instr = &program[curPC >> 2];
+            switch (instr->exec) {
+                case EXEC_ADD: HANDLER(add) RD = (int)(U(RS1) + U(RS2)); NEXT(curPC + 4);
+                case EXEC_SUB: HANDLER(sub) RD = (int)(U(RS1) - U(RS2)); NEXT(curPC + 4);
+                case EXEC_AND: HANDLER(and) RD = RS1 & RS2; NEXT(curPC + 4);
+                case EXEC_OR: HANDLER(or) RD = RS1 | RS2; NEXT(curPC + 4);
+                case EXEC_XOR: HANDLER(xor) RD = RS1 ^ RS2; NEXT(curPC + 4);
+                case EXEC_SLL: HANDLER(sll) RD = (int)(U(RS1) << (RS2 & 31)); NEXT(curPC + 4);
+                case EXEC_SRL: HANDLER(srl) RD = (int)(U(RS1) >> (RS2 & 31)); NEXT(curPC + 4);
+                case EXEC_SRA: HANDLER(sra) RD = RS1 >> (RS2 & 31); NEXT(curPC + 4);
+                case EXEC_SLT: HANDLER(slt) RD = RS1 < RS2; NEXT(curPC + 4);
+                case EXEC_SLTU: HANDLER(sltu) RD = U(RS1) < U(RS2); NEXT(curPC + 4);
+
+                case EXEC_ADDI: HANDLER(addi) RD = (int)(U(RS1) + U(instr->imm)); NEXT(curPC + 4);
+                case EXEC_ANDI: HANDLER(andi) RD = RS1 & instr->imm; NEXT(curPC + 4);
+                case EXEC_ORI: HANDLER(ori) RD = RS1 | instr->imm; NEXT(curPC + 4);
+                case EXEC_XORI: HANDLER(xori) RD = RS1 ^ instr->imm; NEXT(curPC + 4);
+                case EXEC_SLLI: HANDLER(slli) RD = (int)(U(RS1) << (instr->imm & 31)); NEXT(curPC + 4);
+                case EXEC_SRLI: HANDLER(srli) RD = (int)(U(RS1) >> (instr->imm & 31)); NEXT(curPC + 4);
+                case EXEC_SRAI: HANDLER(srai) RD = RS1 >> (instr->imm & 31); NEXT(curPC + 4);
+                case EXEC_SLTI: HANDLER(slti) RD = RS1 < instr->imm; NEXT(curPC + 4);
+                case EXEC_SLTIU: HANDLER(sltiu) RD = U(RS1) < U(instr->imm); NEXT(curPC + 4);
+
+                // Memory accesses may throw MemoryFault; pc is left at the faulting instruction
+                case EXEC_LB: HANDLER(lb) address = RS1 + instr->imm; pc = curPC; RD = dMem.load(address, 0b000); NEXT(curPC + 4);
+                case EXEC_LH: HANDLER(lh) address = RS1 + instr->imm; pc = curPC; RD = dMem.load(address, 0b001); NEXT(curPC + 4);
+                case EXEC_LW: HANDLER(lw) address = RS1 + instr->imm; pc = curPC; RD = dMem.load(address, 0b010); NEXT(curPC + 4);
+                case EXEC_LBU: HANDLER(lbu) address = RS1 + instr->imm; pc = curPC; RD = dMem.load(address, 0b100); NEXT(curPC + 4);
+                case EXEC_LHU: HANDLER(lhu) address = RS1 + instr->imm; pc = curPC; RD = dMem.load(address, 0b101); NEXT(curPC + 4);
+                case EXEC_SB: HANDLER(sb) address = RS1 + instr->imm; pc = curPC; dMem.store(address, 0b000, RS2); NEXT(curPC + 4);
+                case EXEC_SH: HANDLER(sh) address = RS1 + instr->imm; pc = curPC; dMem.store(address, 0b001, RS2); NEXT(curPC + 4);
+                case EXEC_SW: HANDLER(sw) address = RS1 + instr->imm; pc = curPC; dMem.store(address, 0b010, RS2); NEXT(curPC + 4);
+
+                case EXEC_BEQ: HANDLER(beq) NEXT(RS1 == RS2 ? curPC + instr->imm * 4 : curPC + 4);
+                case EXEC_BNE: HANDLER(bne) NEXT(RS1 != RS2 ? curPC + instr->imm * 4 : curPC + 4);
+                case EXEC_BLT: HANDLER(blt) NEXT(RS1 < RS2 ? curPC + instr->imm * 4 : curPC + 4);
+                case EXEC_BGE: HANDLER(bge) NEXT(RS1 >= RS2 ? curPC + instr->imm * 4 : curPC + 4);
+                case EXEC_BLTU: HANDLER(bltu) NEXT(U(RS1) < U(RS2) ? curPC + instr->imm * 4 : curPC + 4);
+                case EXEC_BGEU: HANDLER(bgeu) NEXT(U(RS1) >= U(RS2) ? curPC + instr->imm * 4 : curPC + 4);
+
+                case EXEC_LUI: HANDLER(lui) RD = instr->imm; NEXT(curPC + 4);
+                case EXEC_AUIPC: HANDLER(auipc) RD = curPC + instr->imm; NEXT(curPC + 4);
+                case EXEC_JAL: HANDLER(jal) RD = curPC + 4; NEXT(curPC + instr->imm * 4);
+                case EXEC_J: HANDLER(j) NEXT(curPC + instr->imm * 4);
+                case EXEC_JALR: HANDLER(jalr) address = (RS1 + instr->imm) & ~1; RD = curPC + 4; NEXT((int)address); // rd may equal rs1
+                case EXEC_JR: HANDLER(jr) NEXT((RS1 + instr->imm) & ~1);
+
+                case EXEC_NOP: HANDLER(nop) NEXT(curPC + 4);
+                case EXEC_GENERIC: HANDLER(generic) pc = curPC; NEXT(executeGeneric(*instr, curPC));
+                default: goto done;
+            }
+        } catch (const MemoryFault &) {
+            perf.functionalInstret += retired; // pc already holds the faulting instruction
+            throw;
+        }
+
+#undef HANDLER
+#undef NEXT
+#undef RS1
+#undef RS2
+#undef RD
+#undef U
+    done:
+        pc = curPC;
+        return retired;
+    }
+
+    // Print the registers and key memory words at the end of a cycle
+    void dumpCycle(BufferedWriter &trace) {
+        trace << "\nCycle " << perf.cycles << " Complete.\n";
+        for (int i = 0; i < 8; i++) {
+            trace << " R[" << i << "]: " << GPR[i];
+        }
+        trace << "\ndMem[0]: " << dMem.read32(0) << ", dMem[4]: " << dMem.read32(4) << '\n';
+    }
+
+    // Print the performance counters, branch prediction accuracy and cache statistics
+    void printPerfReport(ostream &out = cout) const {
+        out << "Instructions retired: " << perf.instret + perf.functionalInstret;
+        if (perf.functionalInstret > 0 && perf.instret > 0) out << " (" << perf.functionalInstret << " functional)";
+        out << endl;
+        if (perf.cycles == 0) return; // Nothing ran in the pipeline
+
+        out << fixed << setprecision(2);
+        out << "Cycles: " << perf.cycles << ", CPI: " << (double)perf.cycles / max(perf.instret, 1LL) << endl;
+        out << "Stall cycles: data " << perf.dataStalls << " (" << perf.dataHazards << " hazards), control "
+             << perf.controlStalls << ", flushes " << perf.flushes << ", I-cache " << perf.icacheStalls
+             << ", D-cache " << perf.dcacheStalls << endl;
+        out << "Branches: " << perf.branches << " (" << perf.branchesTaken << " taken), jumps: " << perf.jumps
+             << ", loads: " << perf.loads << ", stores: " << perf.stores << endl;
+        long long resolved = perf.branches + perf.jumps;
+        out << setprecision(1);
+        if (predictor && resolved > 0) {
+            out << "Branch prediction: " << resolved - perf.mispredictions << "/" << resolved << " correct ("
+                 << 100.0 * (resolved - perf.mispredictions) / resolved << "%)" << endl;
+        }
+        for (auto cache : {make_tuple("L1I", iCache.get(), perf.icacheStalls), make_tuple("L1D", dCache.get(), perf.dcacheStalls)}) {
+            const Cache *c = get<1>(cache);
+            if (!c || c->accesses == 0) continue;
+            out << get<0>(cache) << ": " << c->accesses << " accesses, " << c->misses << " misses ("
+                 << 100.0 * (c->accesses - c->misses) / c->accesses << "% hit rate, "
+                 << 1000.0 * c->misses / max(perf.instret, 1LL) << " MPKI), " << get<2>(cache) << " stall cycles";
+            if (c->writebacks > 0) out << ", " << c->writebacks << " writebacks";
+            out << endl;
+        }
+    }
+
+    // Write the performance counters as a JSON object; returns false if the file cannot be written
+    bool writePerfJson(const string &path) const {
+        ofstream out(path);
+        if (!out) return false;
+        pair<const char *, long long> fields[] = {
+            {"cycles", perf.cycles}, {"instret", perf.instret}, {"functional_instret", perf.functionalInstret},
+            {"data_hazards", perf.dataHazards}, {"data_stalls", perf.dataStalls}, {"control_stalls", perf.controlStalls},
+            {"flushes", perf.flushes}, {"icache_stalls", perf.icacheStalls}, {"dcache_stalls", perf.dcacheStalls},
+            {"branches", perf.branches}, {"branches_taken", perf.branchesTaken}, {"jumps", perf.jumps},
+            {"mispredictions", perf.mispredictions}, {"loads", perf.loads}, {"stores", perf.stores},
+        };
+        out << "{";
+        for (auto &field : fields) out << "\n  \"" << field.first << "\": " << field.second << ",";
+        out << "\n  \"cpi\": " << (perf.instret > 0 ? (double)perf.cycles / perf.instret : 0.0) << "\n}\n";
+        return bool(out);
+    }
+};
+
+// Apply one ALU operation to LockstepSimulator::LANES operand pairs. Plain loops the compiler can vectorize
+// with whatever the build targets; switching outside the loops keeps each loop branch-free.
+void ALUExecLanesGeneric(ALUSel sel, const int32_t *a, const int32_t *b, int32_t *out) {
+    const int n = 8;
+    switch (sel) {
+        case ALUSel::AND: for (int i = 0; i < n; i++) out[i] = a[i] & b[i]; break;
+        case ALUSel::OR: for (int i = 0; i < n; i++) out[i] = a[i] | b[i]; break;
+        case ALUSel::ADD: for (int i = 0; i < n; i++) out[i] = (int32_t)((uint32_t)a[i] + (uint32_t)b[i]); break;
+        case ALUSel::SUB: for (int i = 0; i < n; i++) out[i] = (int32_t)((uint32_t)a[i] - (uint32_t)b[i]); break;
+        case ALUSel::XOR: for (int i = 0; i < n; i++) out[i] = a[i] ^ b[i]; break;
+        case ALUSel::SLL: for (int i = 0; i < n; i++) out[i] = (int32_t)((uint32_t)a[i] << (b[i] & 31)); break;
+        case ALUSel::SRL: for (int i = 0; i < n; i++) out[i] = (int32_t)((uint32_t)a[i] >> (b[i] & 31)); break;
+        case ALUSel::SRA: for (int i = 0; i < n; i++) out[i] = a[i] >> (b[i] & 31); break;
+        case ALUSel::SLT: for (int i = 0; i < n; i++) out[i] = a[i] < b[i]; break;
+        case ALUSel::SLTU: for (int i = 0; i < n; i++) out[i] = (uint32_t)a[i] < (uint32_t)b[i]; break;
+        default: for (int i = 0; i < n; i++) out[i] = ALUExec(sel, a[i], b[i]); break;
+    }
+}
+
+#if defined(__x86_64__)
+// AVX2 version: all eight lanes in one 256-bit operation. Compiled for AVX2 regardless of the
+// build flags and only called after a run-time CPU check.
+__attribute__((target("avx2"))) void ALUExecLanesAVX2(ALUSel sel, const int32_t *a, const int32_t *b, int32_t *out) {
+    __m256i x = _mm256_loadu_si256((const __m256i *)a);
+    __m256i y = _mm256_loadu_si256((const __m256i *)b);
+    __m256i shamt = _mm256_and_si256(y, _mm256_set1_epi32(31));
+    __m256i bias = _mm256_set1_epi32(INT_MIN); // Flips the sign bit so a signed compare orders unsigned values
+    __m256i r;
+    switch (sel) {
+        case ALUSel::AND: r = _mm256_and_si256(x, y); break;
+        case ALUSel::OR: r = _mm256_or_si256(x, y); break;
+        case ALUSel::ADD: r = _mm256_add_epi32(x, y); break;
+        case ALUSel::SUB: r = _mm256_sub_epi32(x, y); break;
+        case ALUSel::XOR: r = _mm256_xor_si256(x, y); break;
+        case ALUSel::SLL: r = _mm256_sllv_epi32(x, shamt); break;
+        case ALUSel::SRL: r = _mm256_srlv_epi32(x, shamt); break;
+        case ALUSel::SRA: r = _mm256_srav_epi32(x, shamt); break;
+        case ALUSel::SLT: r = _mm256_srli_epi32(_mm256_cmpgt_epi32(y, x), 31); break;
+        case ALUSel::SLTU: r = _mm256_srli_epi32(_mm256_cmpgt_epi32(_mm256_xor_si256(y, bias), _mm256_xor_si256(x, bias)), 31); break;
+        default: ALUExecLanesGeneric(sel, a, b, out); return;
+    }
+    _mm256_storeu_si256((__m256i *)out, r);
+}
+#endif
+
+// Lane ALU picked once at start-up for the host CPU
+void (*const ALUExecLanes)(ALUSel, const int32_t *, const int32_t *, int32_t *) = [] {
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("avx2")) return ALUExecLanesAVX2;
+#endif
+    return ALUExecLanesGeneric;
+}();
+
+// Lockstep functional simulation of up to LANES instances of one program over different data.
+// Registers are stored structure-of-arrays (GPR[reg][lane]), so one decoded instruction drives every
+// lane with a single vector ALU operation. When lanes disagree on a branch they diverge: each step
+// then runs the lowest pending PC with only the lanes parked there enabled, until their PCs meet again.
+// While every lane is live and converged, runConverged() takes over with pre-decoded ops and no masking,
+// and with AVX2 hot blocks are compiled to native code that runs all lanes at once.
+class LockstepSimulator {
+public:
+    static constexpr int LANES = 8;
+    vector<DecodedInstr> decodedMem; // Pre-decoded program shared by all lanes
+    vector<BlockOp> laneOps; // The same program as translated-block ops, one per instruction, for runConverged()
+    vector<unique_ptr<TranslatedBlock>> blockCache; // Translations indexed by start pc / 4, for the JIT
+    unique_ptr<JitCompiler> jit; // Lane code for hot blocks; null without AVX2 or with the JIT off
+    long long jitThreshold; // Converged entries before a block is compiled, 0 for no JIT
+    int instrNum = 0; // Number of instructions
+    int lanes = 0; // Lanes in use, at most LANES
+    alignas(32) int32_t GPR[32][LANES]; // General purpose registers, one row per register
+    int lanePC[LANES]; // Per-lane program counters, valid while diverged
+    GuestMemory dMem[LANES]; // Per-lane data memory
+    long long instret[LANES]; // Instructions retired per lane
+    string fault[LANES]; // Memory fault that stopped a lane, if any
+    long long steps = 0, divergentSteps = 0; // Instructions issued, and how many ran with lanes masked off
+
+    explicit LockstepSimulator(long long jitThreshold = 0) : jitThreshold(jitThreshold) {}
+
+    // Load a program for the given number of lanes and return every lane to the power-on state
+    void load(const vector<uint32_t> &program, int laneCount) {
+        decodedMem.clear();
+        for (uint32_t instr : program) decodedMem.push_back(decodeInstr(instr));
+        instrNum = program.size();
+        laneOps.clear();
+        for (int i = 0; i < instrNum; i++) laneOps.push_back(laneOp(decodedMem[i], i * 4));
+        lanes = min(laneCount, LANES);
+        blockCache.clear();
+        blockCache.resize(instrNum);
+        jit.reset();
+#if defined(__x86_64__)
+        if (jitThreshold > 0 && __builtin_cpu_supports("avx2")) jit.reset(new JitCompiler((1u << lanes) - 1));
+#endif
+        reset();
+    }
+
+    void reset() {
+        memset(GPR, 0, sizeof(GPR));
+        for (int l = 0; l < LANES; l++) {
+            lanePC[l] = 0;
+            dMem[l] = GuestMemory();
+            instret[l] = 0;
+            fault[l].clear();
+        }
+        steps = divergentSteps = 0;
+    }
+
+    // Map an instruction to the op runConverged() executes. Writes to x0 become EXIT_FALLTHROUGH, which
+    // has no effect; OP_GENERIC and EXIT_JALR are left to the masked step in run(), as are branches with
+    // a reserved funct3.
+    static BlockOp laneOp(const DecodedInstr &instr, int pc) {
+        BlockOp op{OP_GENERIC, instr.rd, instr.rs1, instr.rs2, instr.imm, instr.aluSel, 0};
+        bool isALU = instr.aluSel <= ALUSel::SRA;
+        switch (instr.opcode) {
+            case 0b0110011: if (isALU) op.kind = (BlockKind)(R_AND + (int)instr.aluSel); break; // R-Type
+            case 0b0010011: if (isALU) op.kind = (BlockKind)(I_AND + (int)instr.aluSel); break; // I-Type
+            case 0b0000011: op.kind = instr.rd ? OP_LOAD : OP_LOAD_X0; op.rs2 = instr.funct3; break; // L-Type
+            case 0b0100011: op.kind = OP_STORE; op.rd = instr.rs2; op.rs2 = instr.funct3; return op; // S-Type
+            case 0b1100011: { // B-Type, imm becomes the taken PC
+                static const BlockKind branchKinds[8] = {EXIT_BEQ, EXIT_BNE, OP_GENERIC, OP_GENERIC,
+                                                         EXIT_BLT, EXIT_BGE, EXIT_BLTU, EXIT_BGEU};
+                op.kind = branchKinds[instr.funct3];
+                op.imm = pc + instr.imm * 4;
+                return op;
+            }
+            case 0b0110111: op.kind = OP_LI; break; // LUI
+            case 0b0010111: op.kind = OP_LI; op.imm = pc + instr.imm; break; // AUIPC
+            case 0b1101111: op.kind = EXIT_JAL; op.imm = pc + instr.imm * 4; return op; // JAL, imm becomes the target
+            case 0b1100111: op.kind = EXIT_JALR; return op; // JALR
+            default: op.kind = EXIT_FALLTHROUGH; return op; // No architectural effect
+        }
+        if (instr.rd == 0 && op.kind != OP_LOAD_X0 && op.kind != OP_GENERIC) op.kind = EXIT_FALLTHROUGH;
+        return op;
+    }
+
+    // Converged fast path: with every lane live and on the same PC there is nothing to mask, so each op
+    // is one branch-free row operation across all LANES (spare lanes past `lanes` compute garbage nobody
+    // reads) and loads and stores go lane by lane with no per-lane checks. Hot blocks the JIT can compile
+    // run natively instead, chained to each other. Returns the instructions retired and leaves pc at the
+    // first one it cannot take (a branch that splits the lanes, JALR, OP_GENERIC, a memory fault, or the
+    // end of the program) for the masked step. A faulting access commits nothing, so the masked step can
+    // redo it; re-storing the same values is harmless.
+    long long runConverged(int &pc) {
+        const unsigned limit = (unsigned)instrNum * 4;
+        const unsigned all = (1u << lanes) - 1;
+        const BlockOp *ops = laneOps.data();
+        long long retired = 0;
+        alignas(32) int32_t result[LANES];
+
+#define ROW(expr) \
+    do { \
+        const int32_t *a = GPR[op.rs1], *b = GPR[op.rs2]; \
+        (void)b; \
+        for (int l = 0; l < LANES; l++) result[l] = (expr); \
+        memcpy(GPR[op.rd], result, sizeof(result)); \
+    } while (0)
+#define BRANCH(cond) \
+    do { \
+        const int32_t *a = GPR[op.rs1], *b = GPR[op.rs2]; \
+        unsigned taken = 0; \
+        for (int l = 0; l < LANES; l++) taken |= (unsigned)(cond) << l; \
+        taken &= all; \
+        if (taken == all) nextPC = op.imm; \
+        else if (taken != 0) return retired; \
+    } while (0)
+#define U(x) ((uint32_t)(x))
+
+        while ((unsigned)pc < limit) {
+            if (jit) {
+                TranslatedBlock *block = blockCache[pc >> 2].get();
+                if (!block) blockCache[pc >> 2].reset(block = translateBlock(decodedMem, pc));
+                // A reserved branch ends its block as a fall-through before the end; leave it to the masked step
+                bool reserved = block->exit.kind == EXIT_FALLTHROUGH && (unsigned)block->fallthroughPC < limit;
+                if (!block->native && ++block->execCount == jitThreshold && !reserved) {
+                    block->native = jit->compile(*block, blockCache);
+                }
+                if (block->native) {
+                    long long remaining;
+                    pc = ((JitCompiler::Entry)block->native)(&GPR[0][0], LLONG_MAX, &remaining);
+                    if (remaining == LLONG_MAX) return retired; // Nothing ran: a block opening on a split branch
+                    retired += LLONG_MAX - remaining;
+                    continue;
+                }
+            }
+            const BlockOp &op = ops[pc >> 2];
+            int nextPC = pc + 4;
+            switch (op.kind) {
+                case R_AND: ROW(a[l] & b[l]); break;
+                case R_OR: ROW(a[l] | b[l]); break;
+                case R_ADD: ROW((int32_t)(U(a[l]) + U(b[l]))); break;
+                case R_SLL: ROW((int32_t)(U(a[l]) << (b[l] & 31))); break;
+                case R_XOR: ROW(a[l] ^ b[l]); break;
+                case R_SRL: ROW((int32_t)(U(a[l]) >> (b[l] & 31))); break;
+                case R_SUB: ROW((int32_t)(U(a[l]) - U(b[l]))); break;
+                case R_SLT: ROW(a[l] < b[l]); break;
+                case R_SLTU: ROW(U(a[l]) < U(b[l])); break;
+                case R_SRA: ROW(a[l] >> (b[l] & 31)); break;
+                case I_AND: ROW(a[l] & op.imm); break;
+                case I_OR: ROW(a[l] | op.imm); break;
+                case I_ADD: ROW((int32_t)(U(a[l]) + U(op.imm))); break;
+                case I_SLL: ROW((int32_t)(U(a[l]) << (op.imm & 31))); break;
+                case I_XOR: ROW(a[l] ^ op.imm); break;
+                case I_SRL: ROW((int32_t)(U(a[l]) >> (op.imm & 31))); break;
+                case I_SUB: ROW((int32_t)(U(a[l]) - U(op.imm))); break;
+                case I_SLT: ROW(a[l] < op.imm); break;
+                case I_SLTU: ROW(U(a[l]) < U(op.imm)); break;
+                case I_SRA: ROW(a[l] >> (op.imm & 31)); break;
+                case OP_LI: fill(GPR[op.rd], GPR[op.rd] + LANES, op.imm); break;
+                case OP_LOAD: case OP_LOAD_X0:
+                    try {
+                        for (int l = 0; l < lanes; l++) result[l] = dMem[l].load(GPR[op.rs1][l] + op.imm, op.rs2);
+                    } catch (const MemoryFault &) {
+                        return retired;
+                    }
+                    if (op.kind == OP_LOAD) memcpy(GPR[op.rd], result, sizeof(result));
+                    break;
+                case OP_STORE:
+                    try {
+                        for (int l = 0; l < lanes; l++) dMem[l].store(GPR[op.rs1][l] + op.imm, op.rs2, GPR[op.rd][l]);
+                    } catch (const MemoryFault &) {
+                        return retired;
+                    }
+                    break;
+                case EXIT_BEQ: BRANCH(a[l] == b[l]); break;
+                case EXIT_BNE: BRANCH(a[l] != b[l]); break;
+                case EXIT_BLT: BRANCH(a[l] < b[l]); break;
+                case EXIT_BGE: BRANCH(a[l] >= b[l]); break;
+                case EXIT_BLTU: BRANCH(U(a[l]) < U(b[l])); break;
+                case EXIT_BGEU: BRANCH(U(a[l]) >= U(b[l])); break;
+                case EXIT_JAL:
+                    if (op.rd) fill(GPR[op.rd], GPR[op.rd] + LANES, pc + 4);
+                    nextPC = op.imm;
+                    break;
+                case EXIT_FALLTHROUGH: break;
+                default: return retired;
+            }
+            pc = nextPC;
+            retired++;
+        }
+        return retired;
+
+#undef ROW
+#undef BRANCH
+#undef U
+    }
+
+    // Run every lane until its PC leaves the program or it faults
+    void run() {
+        const unsigned limit = (unsigned)instrNum * 4;
+        unsigned live = 0; // Lanes still running; a lane whose inputs already faulted never starts
+        for (int l = 0; l < lanes; l++) {
+            if (fault[l].empty()) live |= 1u << l;
+        }
+        bool converged = true; // All live lanes share sharedPC
+        int sharedPC = 0;
+        long long sharedRetired = 0; // Instructions every live lane retired while converged
+        alignas(32) int32_t result[LANES], operand[LANES], target[LANES];
+
+        // Retire a lane: fold in the converged instructions it took part in
+        auto finish = [&](int l) {
+            live &= ~(1u << l);
+            instret[l] += sharedRetired;
+        };
+
+        while (live) {
+            if (converged && live == (1u << lanes) - 1) {
+                long long retired = runConverged(sharedPC);
+                sharedRetired += retired;
+                steps += retired;
+            }
+            int pc;
+            unsigned mask;
+            if (converged) {
+                pc = sharedPC;
+                mask = live;
+                if ((unsigned)pc >= limit) {
+                    for (int l = 0; l < lanes; l++) {
+                        if (live >> l & 1) finish(l);
+                    }
+                    break;
+                }
+            } else {
+                // Run the lowest PC first so lanes that skipped ahead wait for the others to catch up
+                pc = INT_MAX;
+                for (int l = 0; l < lanes; l++) {
+                    if (live >> l & 1) pc = min(pc, lanePC[l]);
+                }
+                mask = 0;
+                for (int l = 0; l < lanes; l++) {
+                    if ((live >> l & 1) && lanePC[l] == pc) mask |= 1u << l;
+                }
+                divergentSteps++;
+            }
+            steps++;
+
+            const DecodedInstr &instr = decodedMem[pc >> 2];
+            const int32_t *rs1 = GPR[instr.rs1];
+            int nextPC = pc + 4; // Next PC when every enabled lane agrees
+            bool split = false; // Enabled lanes go to different PCs, given in target
+            switch (instr.opcode) {
+                case 0b0110011: ALUExecLanes(instr.aluSel, rs1, GPR[instr.rs2], result); break; // R-Type
+                case 0b0010011: // I-Type
+                    fill(operand, operand + LANES, instr.imm);
+                    ALUExecLanes(instr.aluSel, rs1, operand, result);
+                    break;
+                case 0b0000011: case 0b0100011: // L-Type, S-Type: memory is per lane
+                    for (int l = 0; l < lanes; l++) {
+                        if (!(mask >> l & 1)) continue;
+                        try {
+                            if (instr.opcode == 0b0000011) result[l] = dMem[l].load(rs1[l] + instr.imm, instr.funct3);
+                            else dMem[l].store(rs1[l] + instr.imm, instr.funct3, GPR[instr.rs2][l]);
+                        } catch (const MemoryFault &e) {
+                            fault[l] = e.what();
+                            mask &= ~(1u << l);
+                            finish(l);
+                        }
+                    }
+                    break;
+                case 0b1100011: { // B-Type
+                    ALUExecLanes(instr.aluSel, rs1, GPR[instr.rs2], result);
+                    unsigned taken = 0;
+                    for (int l = 0; l < lanes; l++) {
+                        if ((mask >> l & 1) && branchTaken(instr.funct3, result[l])) taken |= 1u << l;
+                    }
+                    if (taken == mask) nextPC = pc + instr.imm * 4;
+                    else if (taken != 0) {
+                        split = true;
+                        for (int l = 0; l < lanes; l++) target[l] = (taken >> l & 1) ? pc + instr.imm * 4 : pc + 4;
+                    }
+                    break;
+                }
+                case 0b0110111: fill(result, result + LANES, instr.imm); break; // LUI
+                case 0b0010111: fill(result, result + LANES, pc + instr.imm); break; // AUIPC
+                case 0b1101111: fill(result, result + LANES, pc + 4); nextPC = pc + instr.imm * 4; break; // JAL
+                case 0b1100111: // JALR
+                    fill(result, result + LANES, pc + 4);
+                    nextPC = -1;
+                    for (int l = 0; l < lanes; l++) {
+                        if (!(mask >> l & 1)) continue;
+                        target[l] = (rs1[l] + instr.imm) & ~1;
+                        if (nextPC == -1) nextPC = target[l];
+                        else if (target[l] != nextPC) split = true;
+                    }
+                    break;
+            }
+
+            // Masked register write: a full mask is a straight row copy
+            if (instr.control.RegWrite && instr.rd != 0) {
+                if (mask == (1u << lanes) - 1) memcpy(GPR[instr.rd], result, sizeof(result));
+                else {
+                    for (int l = 0; l < lanes; l++) {
+                        if (mask >> l & 1) GPR[instr.rd][l] = result[l];
+                    }
+                }
+            }
+
+            if (converged && !split && mask == live) {
+                sharedPC = nextPC;
+                sharedRetired++;
+                continue;
+            }
+            if (converged) { // First divergence: give every live lane its own PC
+                for (int l = 0; l < lanes; l++) lanePC[l] = sharedPC;
+                converged = false;
+            }
+            for (int l = 0; l < lanes; l++) {
+                if (!(mask >> l & 1)) continue;
+                instret[l]++;
+                lanePC[l] = split ? target[l] : nextPC;
+            }
+            // Drop lanes that left the program, then reconverge if the rest share a PC
+            int common = -1;
+            bool same = true;
+            for (int l = 0; l < lanes; l++) {
+                if (!(live >> l & 1)) continue;
+                if ((unsigned)lanePC[l] >= limit) {
+                    finish(l);
+                    continue;
+                }
+                if (common == -1) common = lanePC[l];
+                else if (lanePC[l] != common) same = false;
+            }
+            if (live && same) {
+                converged = true;
+                sharedPC = common;
+            }
+        }
+    }
+};
+
+// Differential check for the JIT: run the program on the pipeline model and on the JIT tier, with every
+// eligible block compiled on first use, and compare registers and data memory. Prints the outcome.
+bool checkJitAgainstPipeline(const vector<uint32_t> &program, const vector<uint8_t> &dataImage,
+                             Simulator::Config config) {
+    Simulator pipeline(config);
+    config.blockCache = true;
+    config.jitThreshold = 1;
+    Simulator jitted(config);
+    for (Simulator *sim : {&pipeline, &jitted}) {
+        sim->load(program);
+        sim->dMem.loadImage(0, dataImage.data(), dataImage.size());
+    }
+    string pipelineFault, jitFault; // Memory fault messages; empty when the run completed
+    try {
+        pipeline.run();
+    } catch (const MemoryFault &e) {
+        pipelineFault = e.what();
+    }
+    try {
+        jitted.runFunctional();
+    } catch (const MemoryFault &e) {
+        jitFault = e.what();
+    }
+
+    long long compiled = 0;
+    for (auto &block : jitted.blockCache) compiled += block && block->native;
+    bool match = true;
+    if (jitFault != pipelineFault) {
+        cout << "JIT mismatch: " << (jitFault.empty() ? "no fault" : "fault \"" + jitFault + "\"") << ", pipeline has "
+             << (pipelineFault.empty() ? "no fault" : "fault \"" + pipelineFault + "\"") << endl;
+        match = false;
+    } else if (!pipelineFault.empty()) {
+        cout << "Memory fault: " << pipelineFault << endl;
+    }
+    if (jitted.perf.functionalInstret != pipeline.perf.instret) {
+        cout << "JIT mismatch: " << jitted.perf.functionalInstret << " instructions retired, pipeline has "
+             << pipeline.perf.instret << endl;
+        match = false;
+    }
+    // A fault leaves the pipeline's pc wherever fetch had run ahead to, so the final pc only compares on completion
+    if (pipelineFault.empty() && jitFault.empty() && jitted.pc != pipeline.pc) {
+        cout << "JIT mismatch: pc is " << jitted.pc << ", pipeline has " << pipeline.pc << endl;
+        match = false;
+    }
+    for (int i = 0; i < 32; i++) {
+        if (jitted.GPR[i] != pipeline.GPR[i]) {
+            cout << "JIT mismatch: R[" << i << "] is " << jitted.GPR[i] << ", pipeline has " << pipeline.GPR[i] << endl;
+            match = false;
+        }
+    }
+    if (!(jitted.dMem == pipeline.dMem)) {
+        cout << "JIT mismatch: data memory differs" << endl;
+        match = false;
+    }
+    cout << "JIT check " << (match ? "passed" : "FAILED") << ": " << compiled << " blocks compiled, "
+         << pipeline.perf.instret << " instructions" << endl;
+    return match;
+}
+
+// Static timing estimate of one basic block
+struct BlockTiming {
+    int startPC, endPC; // Byte addresses of the first and last instruction
+    int length; // Instructions
+    double executions; // Product of the trip counts of the annotated loops around the block, else 1
+    int dataStalls; // Data stall cycles per execution, between the block's own instructions
+    double entryStalls; // Data stall cycles on fall-through entries into the block, over all executions
+    double controlCycles; // Control stalls or misprediction flushes over all executions
+};
+
+// Whole-program static timing estimate
+struct TimingEstimate {
+    vector<BlockTiming> blocks;
+    double instructions = 0, cycles = 0; // Totals weighted by block executions
+    double microseconds = 0; // Time the analysis took
+};
+
+// Estimate pipeline timing without simulating. Blocks start at 0, at branch and jump targets and after every
+// branch or jump. Data stalls follow the hazard unit: a reader (readsRegister) right behind a producer
+// stalls one cycle behind a load with forwarding, or two cycles behind any producer without it. Control costs
+// follow the predictor: with stall, one cycle per branch or jump; with static, one flush per taken one;
+// with a BHT or gshare, one cold miss per branch site that is ever taken plus one per change of direction.
+// tripCounts maps the PC of a loop's backward branch or jump to its trip count. Blocks inside the loop run
+// that many times more, and the loop's branch (or its exit branch) is taken accordingly. Without annotations
+// every block runs once and conditional branches fall through. Caches are not modelled.
+TimingEstimate estimateTiming(const vector<uint32_t> &program, const map<int, long long> &tripCounts,
+                              const Simulator::Config &config) {
+    auto start = chrono::steady_clock::now();
+    TimingEstimate estimate;
+    int size = program.size();
+    vector<DecodedInstr> decoded(size);
+    vector<uint8_t> leader(size + 1, 0); // Bytes rather than bits: this loop is the bulk of the analysis
+    leader[0] = 1;
+    for (int i = 0; i < size; i++) {
+        decoded[i] = decodeFields(program[i]);
+        const CtrlWord &control = decoded[i].control;
+        if (!control.Branch && !control.Jump) continue;
+        leader[i + 1] = 1;
+        if (control.Jump != 2 && i + decoded[i].imm >= 0 && i + decoded[i].imm <= size) leader[i + decoded[i].imm] = 1;
+    }
+    estimate.blocks.reserve(count(leader.begin(), leader.end() - 1, 1));
+
+    // Annotated loops as [target, branch] instruction ranges with their trip counts
+    struct Loop { int first, last; long long trips; };
+    vector<Loop> loops;
+    for (auto &annotation : tripCounts) {
+        int index = annotation.first / 4;
+        if (index < 0 || index >= size || annotation.first % 4 || annotation.second < 1) continue;
+        const DecodedInstr &instr = decoded[index];
+        if ((instr.control.Branch || instr.control.Jump == 1) && instr.imm <= 0) {
+            loops.push_back({index + instr.imm, index, annotation.second});
+        }
+    }
+
+    int stallCost = config.forwarding ? 1 : 2;
+    auto stalls = [&](int i) { // Data stall cycles of instruction i right behind instruction i - 1
+        const DecodedInstr &producer = decoded[i - 1];
+        if (!producer.control.RegWrite || producer.rd == 0) return 0;
+        if (config.forwarding && !producer.control.MemRead) return 0;
+        return readsRegister(decoded[i], producer.rd) ? stallCost : 0;
+    };
+    double fallThrough = 0; // Times the previous block ran on into this one rather than branching away
+    for (int begin = 0; begin < size;) {
+        int end = begin + 1;
+        while (end < size && !leader[end]) end++;
+        BlockTiming block{begin * 4, (end - 1) * 4, end - begin, 1.0, 0, 0.0, 0.0};
+        for (const Loop &loop : loops) {
+            if (loop.first <= begin && begin <= loop.last) block.executions *= loop.trips;
+        }
+
+        // Data stalls between neighbours. The instruction before the block only precedes its first one on
+        // fall-through entries: a loop head is entered that way once per run of the loop, and from its
+        // back edge on every other iteration.
+        if (begin > 0) block.entryStalls = fallThrough * stalls(begin);
+        for (int i = begin + 1; i < end; i++) block.dataStalls += stalls(i);
+
+        // Control cost of the block's terminator
+        const DecodedInstr &last = decoded[end - 1];
+        double taken = 0;
+        if (last.control.Branch || last.control.Jump) {
+            double executions = block.executions;
+            if (last.control.Jump) taken = executions;
+            for (const Loop &loop : loops) {
+                if (loop.last == end - 1) taken = executions * (loop.trips - 1) / loop.trips; // Back edge
+                else if (last.control.Branch && loop.first <= end - 1 && end - 1 < loop.last && end - 1 + last.imm > loop.last) {
+                    taken = executions / loop.trips; // Exit from the loop, once per run
+                }
+            }
+            if (config.predictor == PREDICT_STALL) block.controlCycles = executions;
+            else if (config.predictor == PREDICT_STATIC) block.controlCycles = taken;
+            else block.controlCycles = min(executions, min(taken, executions - taken) + (taken > 0));
+        }
+
+        fallThrough = block.executions - taken;
+        estimate.instructions += block.executions * block.length;
+        estimate.cycles += block.executions * (block.length + block.dataStalls) + block.entryStalls + block.controlCycles;
+        estimate.blocks.push_back(block);
+        begin = end;
+    }
+    if (size > 0) estimate.cycles += 1; // The cycle the pipeline takes to drain, as counted by run()
+    estimate.microseconds = chrono::duration<double, micro>(chrono::steady_clock::now() - start).count();
+    return estimate;
+}
+
+// Print the per-block table and the weighted totals of a timing estimate
+void printTimingEstimate(const TimingEstimate &estimate, ostream &out = cout) {
+    out << fixed << setprecision(1);
+    out << "Static timing estimate (" << estimate.blocks.size() << " blocks, " << estimate.microseconds << " us):" << endl;
+    for (const BlockTiming &block : estimate.blocks) {
+        out << "  [" << block.startPC << ", " << block.endPC << "] " << block.length << " instructions x "
+            << block.executions << ": data stalls " << block.dataStalls * block.executions + block.entryStalls
+            << ", control " << block.controlCycles << endl;
+    }
+    out << "Estimated cycles: " << estimate.cycles << ", instructions: " << estimate.instructions << ", CPI: "
+        << setprecision(2) << estimate.cycles / max(estimate.instructions, 1.0) << endl;
+}
+
+// Parse a --trip-count=PC:N option into tripCounts; PC is the byte address of the loop's branch, in decimal
+// or 0x hexadecimal, and N is at least one. Both fields must be consumed whole.
+bool parseTripCount(const string &spec, map<int, long long> &tripCounts) {
+    size_t colon = spec.find(':');
+    if (colon == string::npos) return false;
+    string_view digits(spec.data(), colon);
+    int base = 10;
+    if (digits.size() > 2 && digits[0] == '0' && (digits[1] == 'x' || digits[1] == 'X')) {
+        digits.remove_prefix(2);
+        base = 16;
+    }
+    int pc = 0;
+    long long trips = 0;
+    auto [end, error] = from_chars(digits.data(), digits.data() + digits.size(), pc, base);
+    if (digits.empty() || error != errc() || end != digits.data() + digits.size() || pc < 0) return false;
+    if (!parseOptionValue(spec.substr(colon + 1), trips, 1)) return false;
+    tripCounts[pc] = trips;
+    return true;
+}
+
+// Bundled sample programs, run by main() and timed by the dispatch benchmark. Sum reads its n from
+// address 44 and Fibonacci from address 0.
+const vector<uint32_t> SumSample = {
+    0b00000010110000110010001010000011, 0b00000000000100001000000010010011, 0b00000000000100101000001010010011,
+    0b00000000010100001000001001100011, 0b00000000000100010000000100110011, 0b00000000000100001000000010010011,
+    0b11111111111111111101000111101111, 0b00000000001011111010000000100011,
+};
+const vector<uint32_t> FibonacciSample = {
+    0b00000000000000000010000010000011, 0b00000000000000001000010111100011, 0b00000000000100011000000110010011,
+    0b00000000001100001000010011100011, 0b00000000000100000000000100010011, 0b00000000000100100000001000010011,
+    0b00000000000100010000001101100011, 0b00000000010100100000000110110011, 0b00000000000000100000001010110011,
+    0b00000000000000011000001000110011, 0b00000000000100010000000100010011, 0b11111111111111111011001101101111,
+    0b00000000001100000010001000100011,
+};
+
+// Time the per-instruction interpreter with switch and threaded dispatch on the sample programs, each run
+// for n loop iterations. Block translation is off so every instruction goes through dispatch.
+void runDispatchBenchmark(long long iterations) {
+    struct Sample { const char *name; const vector<uint32_t> *program; uint32_t nAddress; };
+    Sample samples[] = {{"sum", &SumSample, 44}, {"fibonacci", &FibonacciSample, 0}};
+    int n = (int)min(iterations, (long long)INT_MAX - 1);
+    cout << fixed << setprecision(1);
+    for (const Sample &sample : samples) {
+        double mips[2];
+        long long retired = 0;
+        for (int threaded = 0; threaded < 2; threaded++) {
+            Simulator::Config config;
+            config.blockCache = false;
+            config.threadedDispatch = threaded;
+            Simulator sim(config);
+            sim.load(*sample.program);
+            sim.dMem.write32(sample.nAddress, n);
+            auto start = chrono::steady_clock::now();
+            retired = sim.runFunctional();
+            double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+            mips[threaded] = retired / max(seconds, 1e-9) / 1e6;
+        }
+        cout << sample.name << " (n = " << n << ", " << retired << " instructions): switch " << mips[0]
+             << " MIPS, threaded " << mips[1] << " MIPS (" << setprecision(2) << mips[1] / mips[0] << "x)"
+             << setprecision(1) << endl;
+    }
+}
+
+// Read a machine code file: one 32-bit word per line, in binary (optionally 0b-prefixed) or 0x hex.
+// Commas, quotes and // comments are ignored, so SampleCodes.txt and assembler output paste straight in.
+bool loadProgramFile(const string &path, vector<uint32_t> &program) {
+    ifstream in(path);
+    if (!in) return false;
+    program.clear();
+    string line;
+    while (getline(in, line)) {
+        line = line.substr(0, line.find("//"));
+        string word;
+        for (char c : line) {
+            if (!isspace((unsigned char)c) && c != ',' && c != '"') word += c;
+        }
+        if (word.empty()) continue;
+        int base = 2;
+        if (word.rfind("0b", 0) == 0) word = word.substr(2);
+        else if (word.rfind("0x", 0) == 0) {
+            word = word.substr(2);
+            base = 16;
+        }
+        size_t used = 0;
+        try {
+            program.push_back((uint32_t)stoul(word, &used, base));
+        } catch (const exception &) {
+            return false;
+        }
+        if (used != word.size()) return false;
+    }
+    return true;
+}
+
+// Read a data image file (raw bytes, loaded from address 0), as the assembler writes with -d
+bool loadDataFile(const string &path, vector<uint8_t> &image) {
+    ifstream in(path, ios::binary);
+    if (!in) return false;
+    image.assign(istreambuf_iterator<char>(in), istreambuf_iterator<char>());
+    return !in.bad();
+}
+
+// Flat program image as the assembler writes it with -b: a 24-byte header ("RVFI", format version 1, then the
+// file offset and byte size of .text and of .data), the code words and the data image, all little-endian.
+// A regular file is memory-mapped, so data memory can be backed by its pages (GuestMemory::mapImage);
+// anything else is read into a buffer.
+class ProgramImage {
+public:
+    ProgramImage() = default;
+    ProgramImage(const ProgramImage &) = delete;
+    ProgramImage &operator=(const ProgramImage &) = delete;
+    ~ProgramImage() {
+#if defined(__unix__)
+        if (mapping) munmap(mapping, length);
+#endif
+    }
+
+    // Map or read an image file and check its header; returns false if it cannot be read or is malformed
+    bool open(const string &path) {
+        const uint8_t *file = nullptr;
+#if defined(__unix__)
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+        struct stat info;
+        if (fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0) {
+            void *map = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (map != MAP_FAILED) {
+                mapping = map;
+                length = info.st_size;
+                file = (const uint8_t *)map;
+            }
+        }
+        close(fd);
+#endif
+        if (!file) {
+            ifstream in(path, ios::binary);
+            if (!in) return false;
+            buffer.assign(istreambuf_iterator<char>(in), istreambuf_iterator<char>());
+            length = buffer.size();
+            file = buffer.data();
+        }
+
+        if (length < 24 || memcmp(file, "RVFI", 4) != 0 || readWord(file + 4) != 1) return false;
+        uint64_t textOffset = readWord(file + 8), textSize = readWord(file + 12);
+        uint64_t dataOffset = readWord(file + 16), dataBytes = readWord(file + 20);
+        if (textSize % 4 || textOffset + textSize > length || dataOffset + dataBytes > length) return false;
+        text = file + textOffset;
+        textWords = textSize / 4;
+        data = file + dataOffset;
+        dataSize = dataBytes;
+        return true;
+    }
+
+    // The program's instruction words
+    vector<uint32_t> code() const {
+        vector<uint32_t> words(textWords);
+        for (size_t i = 0; i < textWords; i++) words[i] = readWord(text + 4 * i);
+        return words;
+    }
+
+    const uint8_t *data = nullptr; // Initial data memory from address 0
+    size_t dataSize = 0;
+
+private:
+    void *mapping = nullptr; // Mapped file, if the image is a regular file
+    size_t length = 0;
+    vector<uint8_t> buffer; // Image read from a stream
+    const uint8_t *text = nullptr;
+    size_t textWords = 0;
+
+    static uint32_t readWord(const uint8_t *p) {
+        return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+    }
+};
+
+// Thread pool whose workers each own a deque of job indices: a worker takes jobs from the front
+// of its own deque and, once that is empty, steals from the back of the others
+class WorkStealingPool {
+public:
+    explicit WorkStealingPool(int threads) : queues(max(threads, 1)) {}
+
+    // Run work(worker, job) for every job in [0, jobs) and wait for all of them to finish
+    void run(size_t jobs, const function<void(int, size_t)> &work) {
+        int workers = queues.size();
+        // Hand out contiguous blocks so neighbouring jobs (often the same program) stay on one worker
+        for (size_t job = 0; job < jobs; job++) queues[job * workers / jobs].jobs.push_back(job);
+        vector<thread> threads;
+        for (int w = 0; w < workers; w++) {
+            threads.emplace_back([this, w, &work] {
+                size_t job;
+                while (take(w, job)) work(w, job);
+            });
+        }
+        for (thread &t : threads) t.join();
+    }
+
+private:
+    struct Queue {
+        mutex lock;
+        deque<size_t> jobs;
+    };
+    vector<Queue> queues;
+
+    // Next job for a worker; false once every deque is empty (no jobs are added while running)
+    bool take(int self, size_t &job) {
+        for (size_t k = 0; k < queues.size(); k++) {
+            Queue &queue = queues[(self + k) % queues.size()];
+            lock_guard<mutex> guard(queue.lock);
+            if (queue.jobs.empty()) continue;
+            if (k == 0) {
+                job = queue.jobs.front();
+                queue.jobs.pop_front();
+            } else {
+                job = queue.jobs.back();
+                queue.jobs.pop_back();
+            }
+            return true;
+        }
+        return false;
+    }
+};
+
+// One line of a batch manifest: a program, its initial data memory words and the words to report
+struct BatchJob {
+    int program; // Index into the batch's distinct programs
+    vector<pair<uint32_t, int>> inputs; // (byte address, word) stored before the run
+    vector<uint32_t> outputs; // Byte addresses of words to report after the run
+};
+
+// Parse a whole manifest number, decimal or 0x hexadecimal, as a 32-bit word; a leading - only where allowed
+bool parseManifestWord(const string &text, bool allowNegative, uint32_t &word) {
+    string_view digits = text;
+    bool negative = allowNegative && !digits.empty() && digits[0] == '-';
+    if (negative) digits.remove_prefix(1);
+    int base = 10;
+    if (digits.size() > 2 && digits[0] == '0' && (digits[1] == 'x' || digits[1] == 'X')) {
+        digits.remove_prefix(2);
+        base = 16;
+    }
+    uint32_t magnitude = 0;
+    auto [end, error] = from_chars(digits.data(), digits.data() + digits.size(), magnitude, base);
+    if (digits.empty() || error != errc() || end != digits.data() + digits.size()) return false;
+    word = negative ? 0u - magnitude : magnitude;
+    return true;
+}
+
+// Run every job of a manifest on a work-stealing pool and stream one result line per job, in manifest order.
+// Manifest lines look like "fib.txt 0=10 4=1 @4": a machine code file, ADDR=VALUE data words to
+// preload, and @ADDR words to report. Blank lines and lines starting with # are skipped.
+// With lockstep, consecutive jobs of the same program run together in a LockstepSimulator instead.
+// With lockstepCheck, the jobs run both that way and one by one on the functional model, and any job whose
+// result lines differ is reported instead of the results.
+int runBatch(const string &manifestPath, const string &outputPath, const Simulator::Config &config,
+             bool functional, bool lockstep, int threads, bool lockstepCheck = false) {
+    ifstream manifest(manifestPath);
+    if (!manifest) {
+        cout << "Cannot open batch manifest: " << manifestPath << endl;
+        return 1;
+    }
+    vector<string> programNames;
+    vector<vector<uint32_t>> programs; // Each distinct program is parsed once and shared by its jobs
+    map<string, int> programIndex;
+    vector<BatchJob> jobs;
+    string line;
+    for (int lineNo = 1; getline(manifest, line); lineNo++) {
+        stringstream ss(line);
+        string name, token;
+        if (!(ss >> name) || name[0] == '#') continue;
+        if (!programIndex.count(name)) {
+            programs.emplace_back();
+            if (!loadProgramFile(name, programs.back())) {
+                cout << "manifest line " << lineNo << ": cannot read program " << name << endl;
+                return 1;
+            }
+            programIndex[name] = programs.size() - 1;
+            programNames.push_back(name);
+        }
+        BatchJob job;
+        job.program = programIndex[name];
+        while (ss >> token) {
+            bool output = token[0] == '@';
+            size_t eq = token.find('=');
+            uint32_t address = 0, value = 0;
+            if (output ? !parseManifestWord(token.substr(1), false, address)
+                       : eq == string::npos || !parseManifestWord(token.substr(0, eq), false, address)
+                             || !parseManifestWord(token.substr(eq + 1), true, value)) {
+                cout << "manifest line " << lineNo << ": invalid field " << token << endl;
+                return 1;
+            }
+            if (output) job.outputs.push_back(address);
+            else job.inputs.push_back({address, (int)value});
+        }
+        jobs.push_back(job);
+    }
+
+    BufferedWriter out;
+    if (outputPath != "-" && !out.open(outputPath)) {
+        cout << "Cannot open batch output: " << outputPath << endl;
+        return 1;
+    }
+    if (jobs.empty()) return 0;
+
+    // Results are written as soon as every earlier job has finished, so the output order is deterministic;
+    // a lockstep check keeps them all for the comparison instead
+    vector<string> results(jobs.size());
+    vector<char> finished(jobs.size(), 0);
+    size_t nextToWrite = 0;
+    mutex outputLock;
+
+    // Format a job's result line and write out every result that is now next in manifest order
+    auto report = [&](size_t index, const string &faultMessage, long long cycles, long long instret,
+                      const int *regs, int regStride, const GuestMemory &memory) {
+        const BatchJob &job = jobs[index];
+        stringstream result;
+        result << index << " " << programNames[job.program];
+        if (!faultMessage.empty()) result << " fault=\"" << faultMessage << "\"";
+        if (cycles >= 0) result << " cycles=" << cycles;
+        result << " instret=" << instret << " R=";
+        for (int i = 0; i < 32; i++) result << (i ? "," : "") << regs[i * regStride];
+        for (uint32_t address : job.outputs) {
+            result << " @" << address << "=";
+            try {
+                result << memory.read32(address);
+            } catch (const MemoryFault &) {
+                result << "fault";
+            }
+        }
+        result << "\n";
+
+        lock_guard<mutex> guard(outputLock);
+        results[index] = result.str();
+        if (lockstepCheck) return; // Kept for the comparison
+        finished[index] = 1;
+        while (nextToWrite < jobs.size() && finished[nextToWrite]) {
+            out << results[nextToWrite];
+            string().swap(results[nextToWrite]);
+            nextToWrite++;
+        }
+    };
+
+    // Consecutive jobs of the same program run together, up to one per lane
+    auto runLockstep = [&]() {
+        vector<pair<size_t, int>> groups; // (first job, job count)
+        for (size_t index = 0; index < jobs.size(); index++) {
+            if (!groups.empty() && groups.back().second < LockstepSimulator::LANES
+                && jobs[groups.back().first].program == jobs[index].program) groups.back().second++;
+            else groups.push_back({index, 1});
+        }
+        vector<unique_ptr<LockstepSimulator>> sims(max(threads, 1));
+        WorkStealingPool pool(threads);
+        pool.run(groups.size(), [&](int worker, size_t group) {
+            if (!sims[worker]) sims[worker].reset(new LockstepSimulator(config.blockCache ? config.jitThreshold : 0));
+            LockstepSimulator &sim = *sims[worker];
+            size_t first = groups[group].first;
+            int count = groups[group].second;
+            sim.load(programs[jobs[first].program], count);
+            for (int l = 0; l < count; l++) {
+                for (auto &input : jobs[first + l].inputs) {
+                    try {
+                        sim.dMem[l].write32(input.first, input.second);
+                    } catch (const MemoryFault &e) {
+                        sim.fault[l] = e.what();
+                    }
+                }
+            }
+            sim.run();
+            for (int l = 0; l < count; l++) {
+                report(first + l, sim.fault[l], -1, sim.instret[l], &sim.GPR[0][l], LockstepSimulator::LANES, sim.dMem[l]);
+            }
+        });
+    };
+
+    // Jobs run one by one; each worker keeps one simulator and only reloads it when the program changes
+    auto runEach = [&](bool functionalModel) {
+        vector<unique_ptr<Simulator>> sims(max(threads, 1));
+        vector<int> loaded(sims.size(), -1);
+        WorkStealingPool pool(threads);
+        pool.run(jobs.size(), [&](int worker, size_t index) {
+            const BatchJob &job = jobs[index];
+            if (!sims[worker]) sims[worker].reset(new Simulator(config));
+            Simulator &sim = *sims[worker];
+            if (loaded[worker] != job.program) {
+                sim.load(programs[job.program]);
+                loaded[worker] = job.program;
+            } else {
+                sim.reset();
+            }
+
+            string faultMessage;
+            try {
+                for (auto &input : job.inputs) sim.dMem.write32(input.first, input.second);
+                if (functionalModel) sim.runFunctional();
+                else sim.run();
+            } catch (const MemoryFault &e) {
+                faultMessage = e.what();
+            }
+            if (functionalModel) report(index, faultMessage, -1, sim.perf.functionalInstret, sim.GPR, 1, sim.dMem);
+            else report(index, faultMessage, sim.perf.cycles, sim.perf.instret, sim.GPR, 1, sim.dMem);
+        });
+    };
+
+    if (lockstepCheck) {
+        runLockstep();
+        vector<string> laneResults = move(results);
+        results.assign(jobs.size(), string());
+        runEach(true);
+        size_t mismatches = 0;
+        for (size_t index = 0; index < jobs.size(); index++) {
+            if (laneResults[index] == results[index]) continue;
+            if (mismatches++ < 10) cout << "Lockstep mismatch:\n  lockstep:   " << laneResults[index] << "  functional: " << results[index];
+        }
+        cout << "Lockstep check " << (mismatches ? "FAILED" : "passed") << ": " << jobs.size() - mismatches << " of "
+             << jobs.size() << " jobs match the functional model" << endl;
+        return mismatches ? 1 : 0;
+    }
+    if (lockstep) runLockstep();
+    else runEach(functional);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    bool functional = false; // Run the functional model instead of the pipeline
+    bool lockstep = false; // Batch mode: run jobs on the lockstep model instead of the functional one
+    bool jitCheck = false; // Compare the JIT tier against the pipeline instead of simulating
+    bool lockstepCheck = false; // Batch mode: compare lockstep results with the functional model's
+    long long dispatchBenchmark = 0; // Loop iterations for the dispatch benchmark; 0 to simulate normally
+    bool estimate = false; // Print the static timing estimate instead of simulating
+    map<int, long long> tripCounts; // Loop trip counts for the estimate, by the PC of the loop's branch
+    Simulator::Config config;
+    Verbosity verbosity = PER_CYCLE;
+    BufferedWriter trace; // Destination of the per-cycle dumps
+    long long fastForward = 0; // Instructions to run functionally before the pipeline takes over
+    string statsJson; // Where to write the performance counters as JSON, if anywhere
+    string dataPath; // Data image to load instead of the sample inputs
+    string imagePath; // Program image to run instead of the built-in sample
+    string batchManifest, batchOutput = "-"; // Batch mode: job manifest and result file (- for stdout)
+    int threads = max(1u, thread::hardware_concurrency()); // Batch worker threads
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "--functional") functional = true;
+        else if (arg == "--no-forwarding") config.forwarding = false;
+        else if (arg == "--no-block-cache") config.blockCache = false;
+        else if (arg == "--no-jit") config.jitThreshold = 0;
+        else if (arg.rfind("--jit-threshold=", 0) == 0 && parseOptionValue(arg.substr(16), config.jitThreshold, 0)) continue;
+        else if (arg == "--jit-check") jitCheck = true;
+        else if (arg == "--dispatch=switch") config.threadedDispatch = false;
+        else if (arg == "--dispatch=threaded") config.threadedDispatch = true;
+        else if (arg.rfind("--dispatch-benchmark=", 0) == 0 && parseOptionValue(arg.substr(21), dispatchBenchmark, 1)) continue;
+        else if (arg == "--predictor=stall") config.predictor = PREDICT_STALL;
+        else if (arg == "--predictor=static") config.predictor = PREDICT_STATIC;
+        else if (arg == "--predictor=bht") config.predictor = PREDICT_BHT;
+        else if (arg == "--predictor=gshare") config.predictor = PREDICT_GSHARE;
+        else if ((arg.rfind("--icache=", 0) == 0 && parseCacheConfig(arg.substr(9), config.iCacheConfig))
+                 || (arg.rfind("--dcache=", 0) == 0 && parseCacheConfig(arg.substr(9), config.dCacheConfig))) {
+            (arg[2] == 'i' ? config.useICache : config.useDCache) = true;
+        }
+        else if (arg == "--verbosity=none") verbosity = QUIET;
+        else if (arg == "--verbosity=final") verbosity = FINAL_STATE;
+        else if (arg == "--verbosity=cycle") verbosity = PER_CYCLE;
+        else if (arg.rfind("--trace=", 0) == 0) {
+            if (!trace.open(arg.substr(8))) {
+                cout << "Cannot open trace file: " << arg.substr(8) << endl;
+                return 1;
+            }
+        }
+        else if (arg.rfind("--stats-json=", 0) == 0) statsJson = arg.substr(13);
+        else if (arg.rfind("--batch=", 0) == 0) batchManifest = arg.substr(8);
+        else if (arg == "--lockstep") lockstep = true;
+        else if (arg == "--lockstep-check") lockstepCheck = true;
+        else if (arg.rfind("--batch-output=", 0) == 0) batchOutput = arg.substr(15);
+        else if (arg.rfind("--threads=", 0) == 0 && parseOptionValue(arg.substr(10), threads, 1)) continue;
+        else if (arg.rfind("--fast-forward=", 0) == 0 && parseOptionValue(arg.substr(15), fastForward, 0)) continue;
+        else if (arg == "--estimate") estimate = true;
+        else if (arg.rfind("--trip-count=", 0) == 0 && parseTripCount(arg.substr(13), tripCounts)) estimate = true;
+        else if (arg.rfind("--data=", 0) == 0) dataPath = arg.substr(7);
+        else if (arg.rfind("--image=", 0) == 0) imagePath = arg.substr(8);
+        else {
+            cout << "Usage: " << argv[0] << " [--functional] [--fast-forward=N] [--no-block-cache] [--no-jit]"
+                 << " [--jit-threshold=N] [--jit-check] [--dispatch=switch|threaded] [--dispatch-benchmark=N] [--no-forwarding]"
+                 << " [--predictor=stall|static|bht|gshare]"
+                 << " [--icache=SPEC] [--dcache=SPEC] [--verbosity=none|final|cycle] [--trace=FILE]"
+                 << " [--stats-json=FILE] [--batch=MANIFEST] [--batch-output=FILE] [--threads=N]"
+                 << " [--lockstep] [--lockstep-check] [--estimate] [--trip-count=PC:N] [--data=FILE] [--image=FILE]" << endl
+                 << "  SPEC = size:line:ways:lru|plru|random:wb|wt:latency (trailing fields optional)" << endl;
+            return 1;
+        }
+    }
+    if (!dataPath.empty() && !imagePath.empty()) {
+        cout << "--data cannot be combined with --image: the image carries its own data" << endl;
+        return 1;
+    }
+    if (!batchManifest.empty()) return runBatch(batchManifest, batchOutput, config, functional, lockstep, threads, lockstepCheck);
+
+    vector<uint32_t> machineCode = FibonacciSample; // Or SumSample, or your own words
+    
+    Simulator sim(config);
+    // Initial data memory from address 0: the sample inputs (n for Fibonacci at 0, 1 at 4, n for the sum at 44)
+    vector<uint8_t> dataImage(48);
+    dataImage[0] = 10, dataImage[4] = 1, dataImage[44] = 10;
+    if (!dataPath.empty() && !loadDataFile(dataPath, dataImage)) {
+        cout << "Cannot read data file: " << dataPath << endl;
+        return 1;
+    }
+    ProgramImage image; // Program and data from an image file; its data is mapped rather than copied
+    if (!imagePath.empty()) {
+        if (!image.open(imagePath)) {
+            cout << "Cannot read program image: " << imagePath << endl;
+            return 1;
+        }
+        machineCode = image.code();
+        dataImage.clear();
+    }
+    if (dispatchBenchmark > 0) {
+        runDispatchBenchmark(dispatchBenchmark);
+        return 0;
+    }
+    if (estimate) {
+        printTimingEstimate(estimateTiming(machineCode, tripCounts, config));
+        return 0;
+    }
+    if (jitCheck) {
+        if (image.data) dataImage.assign(image.data, image.data + image.dataSize);
+        return checkJitAgainstPipeline(machineCode, dataImage, config) ? 0 : 1;
+    }
+    sim.load(machineCode);
+    sim.dMem.loadImage(0, dataImage.data(), dataImage.size());
+    if (image.data) sim.dMem.mapImage(image.data, image.dataSize);
+    if (verbosity == PER_CYCLE) sim.trace = &trace;
+
+    try {
+        if (functional) {
+            sim.runFunctional();
+        } else {
+            if (fastForward > 0) sim.runFunctional(fastForward);
+            sim.run();
+        }
+    } catch (const MemoryFault &e) {
+        trace.flush();
+        cout << endl << "Memory fault: " << e.what() << endl;
+    }
+    trace.flush();
+    if (verbosity != QUIET) {
+        cout << endl;
+        cout << "Execution Complete." << endl;
+        for (int i = 0; i < 8; i++) {
+            cout << "R[" << i << "]: " << sim.GPR[i] << endl;
+        }
+        cout << "dMem[0] " << sim.dMem.read32(0) << endl;
+        cout << "dMem[4] " << sim.dMem.read32(4) << endl;
+    }
+    sim.printPerfReport();
+    if (!statsJson.empty() && !sim.writePerfJson(statsJson)) {
+        cout << "Cannot write statistics file: " << statsJson << endl;
+        return 1;
+    }
     return 0;
 }
\ No newline at end of file